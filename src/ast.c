@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "parse.h"
+#include "ast.h"
+
+static void visit();
+static Node *clone();
+
+// Traversal helpers
+void visit_block(Node **block, size_t n, void (*fn)(Node *, void *), void *data)
+{
+	for (int i = 0; i < n; i++) {
+		visit(block[i], fn, data);
+	}
+}
+
+static void visit(Node *n, void (*fn)(Node *, void *), void *data)
+{
+	if (n == NULL) {
+		return;
+	}
+
+	fn(n, data);
+
+	if (n->type >= AST_ADD && n->type <= AST_LE) {
+		visit(n->left, fn, data);
+		visit(n->right, fn, data);
+		return;
+	}
+
+	switch (n->type)
+	{
+		case AST_ARRAY:
+			if (n->array_elems) {
+				visit_block(n->array_elems, n->array_size, fn, data);
+			}
+			break;
+		case AST_IDX_ARRAY:
+			visit_block(n->index_values, n->ndim_index, fn, data);
+			break;
+		case AST_FIELD_ACCESS:
+			visit(n->access_rlabel, fn, data);
+			visit(n->access_field, fn, data);
+			break;
+		case AST_FUNCTION_CALL:
+			visit_block(n->callargs, n->n_args, fn, data);
+			break;
+		case AST_IF_STMT:
+			visit(n->if_cond, fn, data);
+			visit_block(n->if_body, n->n_if_stmts, fn, data);
+			visit_block(n->else_body, n->n_else_stmts, fn, data);
+			break;
+		case AST_WHILE_STMT:
+			visit(n->while_cond, fn, data);
+			visit_block(n->while_body, n->n_while_stmts, fn, data);
+			break;
+		case AST_FOR_STMT:
+			visit(n->for_iterator, fn, data);
+			visit(n->for_enum, fn, data);
+			visit_block(n->for_body, n->n_for_stmts, fn, data);
+			break;
+		case AST_RETURN_STMT:
+			visit(n->retval, fn, data);
+			break;
+		case AST_DECLARATION:
+			visit(n->varray_len, fn, data);
+			break;
+	}
+}
+
+void count_node(Node *n, void *data)
+{
+	(*(int *) data)++;
+}
+
+void find_assigned(Node *n, void *data)
+{
+	char **name = data;
+	if (n->type >= AST_ASSIGN && n->type <= AST_MOD_ASSIGN && n->left->type == AST_IDENT) {
+		if (*name && !strcmp(n->left->name, *name)) {
+			*name = NULL;
+		}
+	}
+}
+
+void collect_locals(Node *n, void *data)
+{
+	RenameMap *map = data;
+	if (n->type == AST_DECLARATION) {
+		map->from = realloc(map->from, sizeof(char *) * (map->size+1));
+		map->to = realloc(map->to, sizeof(char *) * (map->size+1));
+		map->subst = realloc(map->subst, sizeof(Node *) * (map->size+1));
+		map->from[map->size] = n->vlabel;
+		map->to[map->size] = NULL;
+		map->subst[map->size] = NULL;
+		map->size++;
+	}
+}
+
+// Node construction
+char *unique_name(char *fn, int k, char *name)
+{
+	// '$' can't appear in source identifiers, so these never collide with the caller's names
+	char *r = malloc(strlen(fn) + strlen(name) + 16);
+	sprintf(r, "%s$%d$%s", fn, k, name);
+	return r;
+}
+
+Node *ident(char *name)
+{
+	return makeNode(&(Node){AST_IDENT, .name=name});
+}
+
+Node *declaration(char *name, int type)
+{
+	return makeNode(&(Node){AST_DECLARATION, .vlabel=name, .vtype=type, .vrlabel=NULL, .v_array_dimensions=0, .varray_size=NULL});
+}
+
+Node *assignment(Node *lhs, Node *rhs)
+{
+	return makeNode(&(Node){AST_ASSIGN, .left=lhs, .right=rhs});
+}
+
+Node *zero_value(int type)
+{
+	if (type == TYPE_BOOL) {
+		return makeNode(&(Node){AST_BOOL, .bval=0});
+	}
+	return makeNode(&(Node){AST_INT, .ival=0});
+}
+
+Node **clone_block(Node **block, size_t n, RenameMap *map)
+{
+	if (block == NULL) {
+		return NULL;
+	}
+
+	Node **r = malloc(sizeof(Node *) * n);
+	for (int i = 0; i < n; i++) {
+		r[i] = clone(block[i], map);
+	}
+	return r;
+}
+
+static char *rename_var(char *name, RenameMap *map, Node **subst)
+{
+	for (int i = 0; i < map->size; i++) {
+		if (!strcmp(map->from[i], name)) {
+			if (subst) {
+				*subst = map->subst[i];
+			}
+			return map->to[i];
+		}
+	}
+
+	return name;
+}
+
+static Node *clone(Node *n, RenameMap *map)
+{
+	if (n == NULL) {
+		return NULL;
+	}
+
+	Node *r = makeNode(n);
+	r->successor = NULL;
+	r->lvar_valproppair = NULL;
+
+	if (n->type >= AST_ADD && n->type <= AST_LE) {
+		r->left = clone(n->left, map);
+		r->right = clone(n->right, map);
+		return r;
+	}
+
+	switch (n->type)
+	{
+		case AST_IDENT:
+		{
+			Node *subst = NULL;
+			r->name = rename_var(n->name, map, &subst);
+			if (subst) {
+				// the argument belongs to the caller, so none of the callee's names apply to it
+				free(r);
+				return clone(subst, &(RenameMap){NULL, NULL, NULL, 0});
+			}
+			break;
+		}
+		case AST_DECLARATION:
+			r->vlabel = rename_var(n->vlabel, map, NULL);
+			if (n->v_array_dimensions) {
+				r->varray_size = malloc(sizeof(int) * n->v_array_dimensions);
+				memcpy(r->varray_size, n->varray_size, sizeof(int) * n->v_array_dimensions);
+			}
+			r->varray_len = clone(n->varray_len, map);
+			break;
+		case AST_ARRAY:
+			r->array_elems = clone_block(n->array_elems, n->array_size, map);
+			break;
+		case AST_IDX_ARRAY:
+			r->ia_label = rename_var(n->ia_label, map, NULL);
+			r->index_values = clone_block(n->index_values, n->ndim_index, map);
+			break;
+		case AST_FUNCTION_CALL:
+			r->callargs = clone_block(n->callargs, n->n_args, map);
+			break;
+		case AST_IF_STMT:
+			r->if_cond = clone(n->if_cond, map);
+			r->if_body = clone_block(n->if_body, n->n_if_stmts, map);
+			r->else_body = clone_block(n->else_body, n->n_else_stmts, map);
+			break;
+		case AST_WHILE_STMT:
+			r->while_cond = clone(n->while_cond, map);
+			r->while_body = clone_block(n->while_body, n->n_while_stmts, map);
+			break;
+		case AST_FOR_STMT:
+			r->for_iterator = clone(n->for_iterator, map);
+			r->for_enum = clone(n->for_enum, map);
+			r->for_body = clone_block(n->for_body, n->n_for_stmts, map);
+			break;
+		case AST_RETURN_STMT:
+			r->retval = clone(n->retval, map);
+			break;
+	}
+
+	return r;
+}
+
+void append(Node ***block, size_t *sz, Node *n)
+{
+	*block = realloc(*block, sizeof(Node *) * (*sz+1));
+	(*block)[(*sz)++] = n;
+}
+
+static int is_named(Node *n, char *name)
+{
+	return n->type == AST_IDENT && !strcmp(n->name, name);
+}
+
+// the variable summed up if a for loop does nothing but 's += x' or 's = s + x', x being its int iterator,
+// the generator vectorizes these loops
+Node *vector_sum(Node *n)
+{
+	Node *it = n->for_iterator;
+	if (n->n_for_stmts != 1 || it->v_array_dimensions || it->vtype != TYPE_INT) {
+		return NULL;
+	}
+
+	Node *s = n->for_body[0];
+	if (s->type != AST_ADD_ASSIGN && s->type != AST_ASSIGN) {
+		return NULL;
+	}
+	Node *sum = s->left;
+	if (sum->type != AST_IDENT || !strcmp(sum->name, it->vlabel)) {
+		return NULL;
+	}
+
+	Node *x;
+	if (s->type == AST_ADD_ASSIGN) {
+		x = s->right;
+	} else if (s->right->type == AST_ADD && is_named(s->right->left, sum->name)) {
+		x = s->right->right;
+	} else if (s->right->type == AST_ADD && is_named(s->right->right, sum->name)) {
+		x = s->right->left;
+	} else {
+		return NULL;
+	}
+
+	return is_named(x, it->vlabel) ? sum : NULL;
+}
@@ -0,0 +1,20 @@
+// AST traversal and construction, shared by the inliner, the loop unroller, compile-time evaluation and the generator
+typedef struct {
+	char **from;
+	char **to;
+	Node **subst;	// replaces the identifier instead of renaming it, if set
+	size_t size;
+} RenameMap;
+
+void visit_block();
+void count_node();
+void find_assigned();
+void collect_locals();
+char *unique_name();
+Node *ident();
+Node *declaration();
+Node *assignment();
+Node *zero_value();
+Node **clone_block();
+void append();
+Node *vector_sum();
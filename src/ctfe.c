@@ -0,0 +1,815 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "parse.h"
+#include "ast.h"
+#include "ctfe.h"
+
+#define CTFE_MAX_STEPS		1000000		// statements and calls a single call site may take to evaluate
+#define CTFE_TOTAL_STEPS	50000000	// same for all call sites of the program together
+#define CTFE_MAX_DEPTH		256		// nested calls
+#define CTFE_MAX_LOCALS		64		// variables a single call may have
+#define CTFE_MEMO_SIZE		4096		// results of earlier calls kept, indexed by a hash of the arguments
+#define CTFE_MAX_TABLE		1024		// entries of a precomputed table
+
+enum {
+	EXEC_FAILED = -1,
+	EXEC_DONE,
+	EXEC_RETURNED,
+};
+
+typedef struct {
+	int type;	// TYPE_INT or TYPE_BOOL
+	int val;
+} Value;
+
+typedef struct {
+	char *name;
+	int type;
+	int known;
+	int val;
+} Binding;
+
+typedef struct {
+	Binding *vars;
+	size_t size;
+} Env;
+
+typedef struct {
+	int fn;		// -1 if unused
+	int *args;
+	Value result;
+} Memo;
+
+typedef struct {
+	char *it;	// name of the iterator
+	int start;
+	int trips;
+	Node **tables;	// declarations of the tables, they go in front of the loop
+	size_t n_tables;
+} RangeLoop;
+
+static int eval();
+static int exec_block();
+
+static Memo memo[CTFE_MEMO_SIZE];
+static long steps;
+static long total_steps;
+static int depth;
+static RangeLoop *loop;	// innermost loop with a known trip count that's being folded, NULL outside of one
+static int table_count;
+
+// Environments
+
+static Binding *lookup(Env *env, char *name)
+{
+	for (int i = 0; i < env->size; i++) {
+		if (!strcmp(env->vars[i].name, name)) {
+			return &env->vars[i];
+		}
+	}
+
+	return NULL;
+}
+
+static Binding *bind(Env *env, char *name, int type)
+{
+	Binding *b = lookup(env, name);
+	if (b == NULL) {
+		if (env->size >= CTFE_MAX_LOCALS) {
+			return NULL;
+		}
+		env->vars = realloc(env->vars, sizeof(Binding) * (env->size+1));
+		b = &env->vars[env->size++];
+		b->name = name;
+	}
+
+	b->type = type;
+	b->known = 0;
+	return b;
+}
+
+static Env copy_env(Env *env)
+{
+	Env r = {malloc(sizeof(Binding) * env->size), env->size};
+	memcpy(r.vars, env->vars, sizeof(Binding) * env->size);
+	return r;
+}
+
+// forgets the values of all variables the block assigns to
+static void forget_assigned(Env *env, Node **block, size_t n)
+{
+	for (int i = 0; i < env->size; i++) {
+		char *name = env->vars[i].name;
+		visit_block(block, n, find_assigned, &name);
+		if (name == NULL) {
+			env->vars[i].known = 0;
+		}
+	}
+}
+
+// Memoization
+
+static unsigned hash(int fn, int *args, size_t n)
+{
+	unsigned h = fn * 2654435761u;
+	for (int i = 0; i < n; i++) {
+		h = (h ^ args[i]) * 16777619u;
+	}
+	return h % CTFE_MEMO_SIZE;
+}
+
+static Memo *find_memo(int fn, int *args, size_t n)
+{
+	Memo *m = &memo[hash(fn, args, n)];
+	if (m->fn == fn && (n == 0 || !memcmp(m->args, args, sizeof(int) * n))) {
+		return m;
+	}
+	return NULL;
+}
+
+static void add_memo(int fn, int *args, size_t n, Value result)
+{
+	Memo *m = &memo[hash(fn, args, n)];
+	free(m->args);
+	m->fn = fn;
+	m->args = malloc(sizeof(int) * n);
+	memcpy(m->args, args, sizeof(int) * n);
+	m->result = result;
+}
+
+// Evaluation
+
+// same results as the generated code: 32-bit ints that wrap around and compare signed
+static int binop(int op, Value l, Value r, Value *out)
+{
+	if (op >= AST_GT && op <= AST_LE) {
+		if (l.type != r.type || (l.type == TYPE_BOOL && op != AST_EQ && op != AST_NE)) {
+			return 0;
+		}
+
+		int v;
+		switch (op)
+		{
+			case AST_GT: v = l.val > r.val; break;
+			case AST_LT: v = l.val < r.val; break;
+			case AST_EQ: v = l.val == r.val; break;
+			case AST_NE: v = l.val != r.val; break;
+			case AST_GE: v = l.val >= r.val; break;
+			default: v = l.val <= r.val; break;
+		}
+		*out = (Value){TYPE_BOOL, v};
+		return 1;
+	}
+
+	if (l.type != TYPE_INT || r.type != TYPE_INT) {
+		return 0;
+	}
+
+	unsigned a = l.val;
+	unsigned b = r.val;
+	unsigned v;
+	switch (op)
+	{
+		case AST_ADD: v = a + b; break;
+		case AST_SUB: v = a - b; break;
+		case AST_MUL: v = a * b; break;
+		case AST_DIV:
+		case AST_MOD:
+			// div is unsigned, whatever negative operands come out as is left to the program
+			if (l.val < 0 || r.val <= 0) {
+				return 0;
+			}
+			v = op == AST_DIV ? a / b : a % b;
+			break;
+		default:
+			return 0;
+	}
+	*out = (Value){TYPE_INT, (int)v};
+	return 1;
+}
+
+// functions that could be evaluated at all, whether a call really can depends on the path it takes
+static int pure_signature(Node *fn)
+{
+	if (fn->is_fn_entrypoint || fn->ret_array_dims || (fn->return_type != TYPE_INT && fn->return_type != TYPE_BOOL)) {
+		return 0;
+	}
+
+	for (int i = 0; i < fn->n_params; i++) {
+		Node *p = fn->fnparams[i];
+		if (p->v_array_dimensions || (p->vtype != TYPE_INT && p->vtype != TYPE_BOOL)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// the return type of the called function, 0 for intrinsics and syscalls
+static int call_type(Node *call)
+{
+	int idx = find_function(call->call_label);
+	return idx < 0 || find_intrinsic(call) ? 0 : global_functions[idx]->return_type;
+}
+
+static int call_function(int idx, int *args, Value *out)
+{
+	Node *fn = global_functions[idx];
+
+	Memo *m = find_memo(idx, args, fn->n_params);
+	if (m) {
+		*out = m->result;
+		return 1;
+	}
+
+	if (depth >= CTFE_MAX_DEPTH) {
+		return 0;
+	}
+
+	Env frame = {NULL, 0};
+	for (int i = 0; i < fn->n_params; i++) {
+		Binding *b = bind(&frame, fn->fnparams[i]->vlabel, fn->fnparams[i]->vtype);
+		b->known = 1;
+		b->val = args[i];
+	}
+
+	depth++;
+	int r = exec_block(fn->fnbody, fn->n_stmts, &frame, out);
+	depth--;
+	free(frame.vars);
+
+	if (r != EXEC_RETURNED || out->type != fn->return_type) {
+		return 0;
+	}
+
+	add_memo(idx, args, fn->n_params, *out);
+	return 1;
+}
+
+static int eval_call(Node *call, Env *env, Value *out)
+{
+	if (--steps < 0 || find_intrinsic(call)) {
+		return 0;
+	}
+
+	int idx = find_function(call->call_label);
+	if (idx < 0) {
+		return 0;
+	}
+
+	Node *fn = global_functions[idx];
+	if (!pure_signature(fn) || call->n_args != fn->n_params) {
+		return 0;
+	}
+
+	int args[call->n_args + 1];
+	for (int i = 0; i < call->n_args; i++) {
+		Value v;
+		if (!eval(call->callargs[i], env, &v) || v.type != fn->fnparams[i]->vtype) {
+			return 0;
+		}
+		args[i] = v.val;
+	}
+
+	return call_function(idx, args, out);
+}
+
+static int eval(Node *e, Env *env, Value *out)
+{
+	if ((e->type >= AST_ADD && e->type <= AST_MOD) || (e->type >= AST_GT && e->type <= AST_LE)) {
+		Value l, r;
+		return eval(e->left, env, &l) && eval(e->right, env, &r) && binop(e->type, l, r, out);
+	}
+
+	switch (e->type)
+	{
+		case AST_INT:
+			*out = (Value){TYPE_INT, e->ival};
+			return 1;
+		case AST_BOOL:
+			*out = (Value){TYPE_BOOL, e->bval};
+			return 1;
+		case AST_IDENT:
+		{
+			Binding *b = lookup(env, e->name);
+			if (b == NULL || !b->known) {
+				return 0;
+			}
+			*out = (Value){b->type, b->val};
+			return 1;
+		}
+		case AST_FUNCTION_CALL:
+			return eval_call(e, env, out);
+	}
+
+	return 0;
+}
+
+static int exec_assign(Node *s, Env *env)
+{
+	Node *lhs = s->left;
+	Binding *b;
+	if (lhs->type == AST_DECLARATION) {
+		if (lhs->v_array_dimensions || (lhs->vtype != TYPE_INT && lhs->vtype != TYPE_BOOL)) {
+			return 0;
+		}
+		b = bind(env, lhs->vlabel, lhs->vtype);
+	} else if (lhs->type == AST_IDENT) {
+		b = lookup(env, lhs->name);
+	} else {
+		return 0;
+	}
+
+	Value v;
+	if (b == NULL || !eval(s->right, env, &v)) {
+		return 0;
+	}
+
+	if (s->type != AST_ASSIGN) {
+		if (!b->known || !binop(s->type - AST_ADD_ASSIGN + AST_ADD, (Value){b->type, b->val}, v, &v)) {
+			return 0;
+		}
+	}
+
+	if (v.type != b->type) {
+		return 0;
+	}
+
+	b->known = 1;
+	b->val = v.val;
+	return 1;
+}
+
+static int exec_for(Node *s, Env *env, Value *out)
+{
+	Node *it = s->for_iterator;
+	Node *e = s->for_enum;
+	if (it->v_array_dimensions || (it->vtype != TYPE_INT && it->vtype != TYPE_BOOL)) {
+		return EXEC_FAILED;
+	}
+
+	int *elems;
+	int n;
+	if (e->type == AST_FUNCTION_CALL && find_intrinsic(e) == INTRINSIC_RANGE) {
+		Value start, end;
+		if (it->vtype != TYPE_INT || !eval(e->callargs[0], env, &start) || !eval(e->callargs[1], env, &end)
+		    || start.type != TYPE_INT || end.type != TYPE_INT) {
+			return EXEC_FAILED;
+		}
+		n = end.val > start.val ? end.val - start.val : 0;
+		if (n > steps) {
+			return EXEC_FAILED;
+		}
+		elems = malloc(sizeof(int) * n);
+		for (int i = 0; i < n; i++) {
+			elems[i] = start.val + i;
+		}
+	} else if (e->type == AST_ARRAY) {
+		n = e->array_size;
+		elems = malloc(sizeof(int) * n);
+		for (int i = 0; i < n; i++) {
+			Value v;
+			if (!eval(e->array_elems[i], env, &v) || v.type != it->vtype) {
+				free(elems);
+				return EXEC_FAILED;
+			}
+			elems[i] = v.val;
+		}
+	} else {
+		return EXEC_FAILED;
+	}
+
+	Binding *b = bind(env, it->vlabel, it->vtype);
+	int r = b ? EXEC_DONE : EXEC_FAILED;
+	for (int i = 0; i < n && r == EXEC_DONE; i++) {
+		// the body may have declared new variables, so the binding can have moved
+		b = lookup(env, it->vlabel);
+		b->known = 1;
+		b->val = elems[i];
+		r = exec_block(s->for_body, s->n_for_stmts, env, out);
+	}
+
+	free(elems);
+	return r;
+}
+
+static int exec_block(Node **block, size_t n, Env *env, Value *out)
+{
+	for (int i = 0; i < n; i++) {
+		Node *s = block[i];
+		if (--steps < 0) {
+			return EXEC_FAILED;
+		}
+
+		int r = EXEC_DONE;
+		Value cond;
+		switch (s->type)
+		{
+			case AST_DECLARATION:
+				if (s->v_array_dimensions || (s->vtype != TYPE_INT && s->vtype != TYPE_BOOL) || !bind(env, s->vlabel, s->vtype)) {
+					return EXEC_FAILED;
+				}
+				break;
+			case AST_ASSIGN:
+			case AST_ADD_ASSIGN:
+			case AST_SUB_ASSIGN:
+			case AST_MUL_ASSIGN:
+			case AST_DIV_ASSIGN:
+			case AST_MOD_ASSIGN:
+				if (!exec_assign(s, env)) {
+					return EXEC_FAILED;
+				}
+				break;
+			case AST_IF_STMT:
+				if (!eval(s->if_cond, env, &cond) || cond.type != TYPE_BOOL) {
+					return EXEC_FAILED;
+				}
+				if (cond.val) {
+					r = exec_block(s->if_body, s->n_if_stmts, env, out);
+				} else {
+					r = exec_block(s->else_body, s->n_else_stmts, env, out);
+				}
+				break;
+			case AST_WHILE_STMT:
+				while (r == EXEC_DONE) {
+					if (!eval(s->while_cond, env, &cond) || cond.type != TYPE_BOOL) {
+						return EXEC_FAILED;
+					} else if (!cond.val) {
+						break;
+					}
+					r = exec_block(s->while_body, s->n_while_stmts, env, out);
+				}
+				break;
+			case AST_FOR_STMT:
+				r = exec_for(s, env, out);
+				break;
+			case AST_RETURN_STMT:
+				if (s->retval == NULL || !eval(s->retval, env, out)) {
+					return EXEC_FAILED;
+				}
+				return EXEC_RETURNED;
+			case AST_FUNCTION_CALL:
+				if (!eval_call(s, env, &cond)) {
+					return EXEC_FAILED;
+				}
+				break;
+			default:
+				return EXEC_FAILED;
+		}
+
+		if (r != EXEC_DONE) {
+			return r;
+		}
+	}
+
+	return EXEC_DONE;
+}
+
+// Folding
+
+// builds a table of the call's results for every iteration of the innermost counted loop and replaces
+// the call with a lookup in it
+static int precompute(Node *call, Env *env)
+{
+	if (loop == NULL || call_type(call) != TYPE_INT) {
+		return 0;
+	}
+
+	Binding *b = lookup(env, loop->it);
+	if (b == NULL) {
+		return 0;
+	}
+	Binding saved = *b;
+
+	Node **elems = malloc(sizeof(Node *) * loop->trips);
+	int i;
+	for (i = 0; i < loop->trips; i++) {
+		Value v;
+		*b = (Binding){saved.name, TYPE_INT, 1, loop->start + i};
+		if (!eval_call(call, env, &v)) {
+			break;
+		}
+		elems[i] = makeNode(&(Node){AST_INT, .ival=v.val});
+	}
+	*b = saved;
+
+	if (i < loop->trips) {
+		free(elems);
+		return 0;
+	}
+
+	char *name = unique_name("ctfe", table_count++, "");
+	int *size = malloc(sizeof(int));
+	size[0] = loop->trips;
+	Node *decl = makeNode(&(Node){AST_DECLARATION, .vlabel=name, .vtype=TYPE_INT, .vrlabel=NULL, .v_array_dimensions=1, .varray_size=size});
+	Node *table = makeNode(&(Node){AST_ARRAY, .array_size=loop->trips, .array_elems=elems});
+	append(&loop->tables, &loop->n_tables, assignment(decl, table));
+
+	Node **index = malloc(sizeof(Node *));
+	index[0] = ident(loop->it);
+	if (loop->start) {
+		index[0] = makeNode(&(Node){AST_SUB, .left=index[0], .right=makeNode(&(Node){AST_INT, .ival=loop->start})});
+	}
+	*call = (Node){AST_IDX_ARRAY, .ia_label=name, .index_values=index, .ndim_index=1};
+
+	return 1;
+}
+
+// replaces the call with its result if it can be evaluated
+static void fold_call(Node *call, Env *env)
+{
+	if (total_steps <= 0) {
+		return;
+	}
+
+	steps = CTFE_MAX_STEPS < total_steps ? CTFE_MAX_STEPS : total_steps;
+	depth = 0;
+
+	long budget = steps;
+	Value v;
+	if (eval_call(call, env, &v)) {
+		*call = v.type == TYPE_BOOL ? (Node){AST_BOOL, .bval=v.val} : (Node){AST_INT, .ival=v.val};
+	} else {
+		precompute(call, env);
+	}
+
+	total_steps -= budget - (steps > 0 ? steps : 0);
+}
+
+static void fold_expr(Node *e, Env *env)
+{
+	if (e == NULL) {
+		return;
+	}
+
+	if (e->type >= AST_ADD && e->type <= AST_LE) {
+		fold_expr(e->left, env);
+		fold_expr(e->right, env);
+		return;
+	}
+
+	switch (e->type)
+	{
+		case AST_ARRAY:
+			for (int i = 0; i < e->array_size && e->array_elems; i++) {
+				fold_expr(e->array_elems[i], env);
+			}
+			break;
+		case AST_IDX_ARRAY:
+			for (int i = 0; i < e->ndim_index; i++) {
+				fold_expr(e->index_values[i], env);
+			}
+			break;
+		case AST_FUNCTION_CALL:
+			for (int i = 0; i < e->n_args; i++) {
+				fold_expr(e->callargs[i], env);
+			}
+			fold_call(e, env);
+			break;
+	}
+}
+
+// the value of a folded expression, without evaluating any calls that are left in it
+static int known_value(Node *e, Env *env, Value *out)
+{
+	steps = 0;
+	return eval(e, env, out);
+}
+
+// sets up the table context for 'for (int i : range(start, end))' with known bounds and an i the body leaves alone
+static int range_loop(Node *s, Env *env, RangeLoop *r)
+{
+	Node *e = s->for_enum;
+	Value start, end;
+	if (s->for_iterator->v_array_dimensions || s->for_iterator->vtype != TYPE_INT
+	    || e->type != AST_FUNCTION_CALL || find_intrinsic(e) != INTRINSIC_RANGE
+	    || !known_value(e->callargs[0], env, &start) || !known_value(e->callargs[1], env, &end)
+	    || start.type != TYPE_INT || end.type != TYPE_INT
+	    || end.val <= start.val || (long)end.val - start.val > CTFE_MAX_TABLE) {
+		return 0;
+	}
+
+	char *name = s->for_iterator->vlabel;
+	visit_block(s->for_body, s->n_for_stmts, find_assigned, &name);
+	if (name == NULL) {
+		return 0;
+	}
+
+	*r = (RangeLoop){s->for_iterator->vlabel, start.val, end.val - start.val, NULL, 0};
+	return 1;
+}
+
+// same for 'while (i < end) { ...; i += 1; }' with i and end known in front of the loop
+static int counted_loop(Node *s, Env *env, RangeLoop *r)
+{
+	Node *cond = s->while_cond;
+	size_t n = s->n_while_stmts;
+	if ((cond->type != AST_LT && cond->type != AST_LE) || cond->left->type != AST_IDENT
+	    || (cond->right->type != AST_INT && cond->right->type != AST_IDENT) || !n) {
+		return 0;
+	}
+	char *var = cond->left->name;
+
+	Value start, end;
+	if (!known_value(cond->left, env, &start) || !known_value(cond->right, env, &end)
+	    || start.type != TYPE_INT || end.type != TYPE_INT) {
+		return 0;
+	}
+	long trips = (long)end.val + (cond->type == AST_LE) - start.val;
+	if (trips <= 0 || trips > CTFE_MAX_TABLE) {
+		return 0;
+	}
+
+	// the increment ends the body and nothing else changes i or end
+	Node *last = s->while_body[n-1];
+	Node *one = NULL;
+	if (last->type == AST_ADD_ASSIGN && last->left->type == AST_IDENT && !strcmp(last->left->name, var)) {
+		one = last->right;
+	} else if (last->type == AST_ASSIGN && last->left->type == AST_IDENT && !strcmp(last->left->name, var)
+		   && last->right->type == AST_ADD && last->right->left->type == AST_IDENT && !strcmp(last->right->left->name, var)) {
+		one = last->right->right;
+	}
+	if (one == NULL || one->type != AST_INT || one->ival != 1) {
+		return 0;
+	}
+
+	char *name = var;
+	visit_block(s->while_body, n-1, find_assigned, &name);
+	if (name == NULL) {
+		return 0;
+	}
+	if (cond->right->type == AST_IDENT) {
+		name = cond->right->name;
+		visit_block(s->while_body, n, find_assigned, &name);
+		if (name == NULL) {
+			return 0;
+		}
+	}
+
+	*r = (RangeLoop){var, start.val, trips, NULL, 0};
+	return 1;
+}
+
+// Folds calls in the block, env holds what's known about the variables of the caller at its start.
+static Node **fold_block(Node **block, size_t *n, Env *env)
+{
+	Node **out = NULL;
+	size_t out_sz = 0;
+
+	for (int i = 0; i < *n; i++) {
+		Node *s = block[i];
+		Env inner;
+		Value v = {0, 0};
+
+		switch (s->type)
+		{
+			case AST_DECLARATION:
+				fold_expr(s->varray_len, env);
+				bind(env, s->vlabel, s->v_array_dimensions ? -1 : s->vtype);
+				break;
+			case AST_ASSIGN:
+			case AST_ADD_ASSIGN:
+			case AST_SUB_ASSIGN:
+			case AST_MUL_ASSIGN:
+			case AST_DIV_ASSIGN:
+			case AST_MOD_ASSIGN:
+			{
+				fold_expr(s->left, env);
+				fold_expr(s->right, env);
+
+				Node *lhs = s->left;
+				char *name;
+				int type = 0;
+				if (lhs->type == AST_DECLARATION) {
+					name = lhs->vlabel;
+					type = lhs->v_array_dimensions ? -1 : lhs->vtype;
+				} else if (lhs->type == AST_IDENT) {
+					name = lhs->name;
+				} else {
+					break;
+				}
+
+				Binding *b = lookup(env, name);
+				if (b && !type) {
+					type = b->type;
+				}
+
+				int known = known_value(s->right, env, &v);
+				if (known && s->type != AST_ASSIGN) {
+					known = b && b->known && binop(s->type - AST_ADD_ASSIGN + AST_ADD, (Value){b->type, b->val}, v, &v);
+				}
+				known = known && (!type || type == v.type);
+
+				b = bind(env, name, known ? v.type : type);
+				if (b && known) {
+					b->known = 1;
+					b->val = v.val;
+				}
+				break;
+			}
+			case AST_IF_STMT:
+				fold_expr(s->if_cond, env);
+				inner = copy_env(env);
+				s->if_body = fold_block(s->if_body, &s->n_if_stmts, &inner);
+				free(inner.vars);
+				inner = copy_env(env);
+				s->else_body = fold_block(s->else_body, &s->n_else_stmts, &inner);
+				free(inner.vars);
+
+				forget_assigned(env, s->if_body, s->n_if_stmts);
+				forget_assigned(env, s->else_body, s->n_else_stmts);
+				break;
+			case AST_WHILE_STMT:
+			{
+				RangeLoop *outer = loop;
+				RangeLoop r;
+				if (counted_loop(s, env, &r)) {
+					loop = &r;
+				}
+
+				// any value set in the body may be seen by the condition or the body itself
+				forget_assigned(env, s->while_body, s->n_while_stmts);
+				fold_expr(s->while_cond, env);
+				inner = copy_env(env);
+				s->while_body = fold_block(s->while_body, &s->n_while_stmts, &inner);
+				free(inner.vars);
+
+				if (loop == &r) {
+					for (int j = 0; j < r.n_tables; j++) {
+						append(&out, &out_sz, r.tables[j]);
+					}
+				}
+				loop = outer;
+				break;
+			}
+			case AST_FOR_STMT:
+			{
+				fold_expr(s->for_enum, env);
+
+				RangeLoop *outer = loop;
+				RangeLoop r;
+				if (range_loop(s, env, &r)) {
+					loop = &r;
+				}
+
+				forget_assigned(env, s->for_body, s->n_for_stmts);
+				bind(env, s->for_iterator->vlabel, s->for_iterator->vtype);
+				inner = copy_env(env);
+				s->for_body = fold_block(s->for_body, &s->n_for_stmts, &inner);
+				free(inner.vars);
+
+				if (loop == &r) {
+					for (int j = 0; j < r.n_tables; j++) {
+						append(&out, &out_sz, r.tables[j]);
+					}
+				}
+				loop = outer;
+				break;
+			}
+			case AST_RETURN_STMT:
+				fold_expr(s->retval, env);
+				break;
+			case AST_FUNCTION_CALL:
+				// a call on its own is kept, only its arguments are folded
+				for (int j = 0; j < s->n_args; j++) {
+					fold_expr(s->callargs[j], env);
+				}
+				break;
+		}
+
+		append(&out, &out_sz, s);
+	}
+
+	*n = out_sz;
+	return out;
+}
+
+// Evaluates calls of functions that only compute an int or bool from int and bool arguments at
+// compile time, if the arguments are known, and replaces them with their result. Calls inside a
+// counted loop that only depend on its iterator become lookups in a table of their results instead. Anything the evaluator doesn't understand or that has side effects, like a
+// print or a syscall, makes it give up on the call, as does running out of steps.
+void evaluate_calls()
+{
+	static int initialized = 0;
+	if (!initialized) {
+		for (int i = 0; i < CTFE_MEMO_SIZE; i++) {
+			memo[i].fn = -1;
+		}
+		total_steps = CTFE_TOTAL_STEPS;
+		initialized = 1;
+	}
+
+	for (int i = 0; i < global_function_count; i++) {
+		Node *fn = global_functions[i];
+		Env env = {NULL, 0};
+		for (int j = 0; j < fn->n_params; j++) {
+			Node *p = fn->fnparams[j];
+			bind(&env, p->vlabel, p->v_array_dimensions ? -1 : p->vtype);
+		}
+		loop = NULL;
+		fn->fnbody = fold_block(fn->fnbody, &fn->n_stmts, &env);
+		free(env.vars);
+	}
+}
@@ -0,0 +1 @@
+void evaluate_calls();
@@ -2,10 +2,53 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <ctype.h>
 
 #include "parse.h"
 #include "gen.h"
 #include "error.h"
+#include "ast.h"
+#include "report.h"
+
+enum MnemType {
+	MOV = 1,
+	LEA,
+	ADD,
+	SUB,
+	IMUL,
+	AND,
+	OR,
+	SHR,
+	SHL,
+	VEC,	// SSE/AVX instruction, the xmm/ymm registers it names aren't tracked
+	CMP,
+	INC,
+	DEC,
+	DIV,
+	NEG,
+	NOT,
+	JE,
+	JNE,
+	JL,
+	JLE,
+	JG,
+	JGE,
+	JMP,
+	GOTO,
+	CALL,
+	PUSH,
+	POP,
+	RET,
+	BRACKET_EXPR,
+	BRACKET_ADD,
+	VIRTUAL_REG,
+	REAL_REG,
+	LABEL,
+	LITERAL,
+	SPECIFIER,
+	SYSCALL,
+	NEWLINE,
+};
 
 #define MAX_REGISTER_COUNT 14
 
@@ -21,6 +64,19 @@ static char *W_REGS[] = {"ax", "bx", "cx", "dx", "si", "di",
 static char *B_REGS[] = {"al", "bl", "cl", "dl", "sil", "dil",
 		       	 "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"};
 
+// System V AMD64 calling convention: rdi, rsi, rdx, rcx, r8, r9
+#define N_ARG_REGS 6
+static int ARG_REGS[N_ARG_REGS] = {5, 4, 3, 2, 6, 7};
+
+#define REG_BIT(x)	(1 << (x))
+// rax, rcx, rdx, rsi, rdi, r8 - r11
+#define CALLER_SAVED_MASK	0x3fd
+// rbx, r12 - r15
+#define CALLEE_SAVED_MASK	0x3c02
+
+// caller-saved registers are handed out first, so that leaf code doesn't have to save anything
+static int COLOR_ORDER[MAX_REGISTER_COUNT] = {0, 2, 3, 4, 5, 6, 7, 8, 9, 1, 10, 11, 12, 13};
+
 static int vregs_idx;
 static int vregs_count;
 
@@ -29,6 +85,40 @@ static int stack_offset;
 static FILE *outputfp;
 static int entrypoint_defined;
 
+// bytes below rsp that signal handlers leave alone (System V red zone)
+#define RED_ZONE_SIZE 128
+
+// 4-byte ints per vector in vectorized loops, every one of them sits in an 8-byte slot
+#define VECTOR_LANES	(avx2 ? 4 : 2)
+
+static Frame *frames;
+
+// set once something calls into the runtime appended to the program
+static int uses_runtime;
+
+// constant array literals with at least this many members are kept in .rodata and copied from
+// there, shorter ones take fewer instructions as immediate stores
+#define RODATA_MIN_MEMBERS 16
+
+// copies of more members than this go through rep movsq instead of vector moves
+#define REP_MOVS_MIN_MEMBERS 128
+
+// bytes of output collected before they are written, matches rt_out_buf
+#define RT_OUT_SIZE 65536
+
+// strings the loops currently being generated are building
+static Builder *builders;
+static size_t builders_sz;
+
+// scalars kept in virtual registers instead of their stack slot
+static ValPropPair **promoted;
+static int *promoted_func;
+static size_t promoted_sz;
+
+static Hoisted *hoisted;
+static size_t hoisted_sz;
+static int hoist_groups;
+
 static void emit_func_prologue();
 static void emit_block();
 static void emit_expr();
@@ -36,26 +126,50 @@ static void emit_literal();
 static void emit_declaration();
 static void emit_assign();
 static void emit_store();
+static void emit_element_address();
 static void emit_store_offset();
+static void emit_store_var();
+static int promote();
 static void emit_lvar();
+static void emit_array_base();
 static void emit_if();
 static void emit_while();
 static void emit_for();
+static void emit_loop();
+static int emit_builder_extension();
+static void count_mentions();
 static int emit_array_assign();
 static int emit_offset_assign();
 static void emit_int_arith_binop();
 static size_t *emit_string_assign();
 static size_t emit_string_arith_binop();
+static size_t emit_string_piece();
+static void emit_piece_copy();
+static void emit_movsb();
+static void emit_movsq();
+static void emit_runtime_call();
+static void emit_array_len();
+static void emit_intrinsic();
 static void emit_func_call();
 static void emit_syscall();
 
 static int do_array_arithmetic();
+static int is_dynamic();
+static int returns_dynamic();
+static int is_dynamic_call();
+static int emit_dynamic_temp();
+static void emit_dynamic_assign();
+static void emit_dynamic_operands();
+static void emit_dynamic_append();
+static void emit_dynamic_for();
 
 static int **getArrayMembers();
+static void emit_array_members();
+static char *emit_rodata_array();
+static int emit_rodata_copy();
 static int *getArraySizes();
 
 static InterferenceNode **lva();
-static void sortByColor();
 static void gen_nasm();
 
 #define emit(...)		emitf("\t"  __VA_ARGS__)
@@ -98,6 +212,12 @@ static void getStringLens(Node *n, size_t *pair)
 	switch (n->type)
 	{
 		case AST_FUNCTION_CALL:
+			// intrinsics have no body, intToStr gives at most 11 characters
+			if (find_intrinsic(n)) {
+				pair[0] = 0;
+				pair[1] = 11;
+				break;
+			}
 	 		getStringLens(global_functions[n->global_function_idx]->return_stmt->retval, pair);
 			break;
 		case AST_IDENT:
@@ -150,7 +270,7 @@ static int is_instruction_mnemonic(char *mnem)
 		off = 1;
 	}
 
-	if (MATCHES("mov")) {
+	if (MATCHES("mov") || MATCHES("movzx")) {
 		return MOV;
 	} else if (MATCHES("lea")) {
 		return LEA;
@@ -206,6 +326,16 @@ static int is_instruction_mnemonic(char *mnem)
 		return RET;
 	}
 
+	static char *vector_mnemonics[] = {
+		"movdqu", "movdqa", "movd", "movq", "pxor", "paddd", "psrldq", "punpcklqdq",
+		"vmovdqu", "vmovd", "vmovq", "vpxor", "vpaddd", "vpsrldq", "vextracti128", "vpbroadcastq",
+	};
+	for (int i = 0; i < sizeof(vector_mnemonics) / sizeof(char *); i++) {
+		if (MATCHES(vector_mnemonics[i])) {
+			return VEC;
+		}
+	}
+
 	return 0;
 }
 
@@ -216,7 +346,7 @@ static int is_assignment_mnemonic(char *mnem)
 		off = 1;
 	}
 
-	if (MATCHES("mov")) {
+	if (MATCHES("mov") || MATCHES("movzx")) {
 		return MOV;
 	} else if (MATCHES("lea")) {
 		return LEA;
@@ -296,8 +426,6 @@ static int realRegToIdx(char *mnem, char *mode)
 int current_func;
 MnemNode *makeMnemNode(char *mnem)
 {
-	static int in_loop = 0;
-
 	if (mnem[0] == '\0') {
 		return NULL;
 	}
@@ -317,6 +445,9 @@ MnemNode *makeMnemNode(char *mnem)
 
 	r->is_function_label = -1;
 
+	r->implicit_uses = 0;
+	r->implicit_defs = 0;
+
 	if (mnem[0] == '\n') {
 		r->type = NEWLINE;
 		r->mnem = "\n";
@@ -370,8 +501,6 @@ MnemNode *makeMnemNode(char *mnem)
 			type = VIRTUAL_REG;
 		} else if (mnem_p[strlen(mnem)-1] == ':') {
 			type = LABEL;
-			if (!strncmp(mnem_p, "Loop", 4))
-				in_loop++;
 
 			char *func_name = malloc(strlen(mnem));
 			strcpy(func_name, mnem_p);
@@ -395,9 +524,6 @@ MnemNode *makeMnemNode(char *mnem)
 			type = SPECIFIER;
 		} else if (!strcmp(&mnem_p[off], "syscall")) {
 			type = SYSCALL;
-			r->in_loop = in_loop;
-		} else if (!strncmp(mnem_p, "Loop", 4)) {
-			in_loop--;
 		} else {
 			idx = realRegToIdx(&mnem_p[off], &mode);
 			if (idx >= 0) {
@@ -427,6 +553,7 @@ MnemNode *makeMnemNode(char *mnem)
 	}
 
 	r->ret_belongs_to = ret_belongs_to;
+	r->call_to = -1;
 	r->idx = idx;
 	r->mode = mode;
 
@@ -487,6 +614,12 @@ static void emitf(char *fmt, ...) {
 				prev_ins = 1;
 				clear(mnem);
 				mnem_len = 0;
+
+				if (c == '\0') {	// instruction without operands
+					ins_array = realloc(ins_array, (ins_array_sz+1) * sizeof(MnemNode *));
+					ins_array[ins_array_sz++] = ins;
+					break;
+				}
 			} else if (ins != NULL && prev_ins) {
 				MnemNode *next;
 				if (ins->left == NULL) {
@@ -497,7 +630,7 @@ static void emitf(char *fmt, ...) {
 						ins->left_spec = next;
 					}
 
-					if (ins->type == CALL) {
+					if (ins->type == CALL && !strncmp(ins->left->mnem, "fn_", 3)) {
 						for (int i = 0; i < global_function_count; i++) {
 							if (!strcmp(global_functions[i]->flabel, &ins->left->mnem[3])) {
 								ins->call_to = i;
@@ -565,15 +698,434 @@ static void emitf(char *fmt, ...) {
 	}
 }
 
+// Heap for strings and dynamic arrays, appended to programs that need it. Blocks come in power-of-two size classes
+// from 16 bytes up and start with an 8-byte header holding their class. Freed blocks go onto the
+// list of their class, new ones are cut from 1 MiB arenas mapped with mmap. Strings built up in
+// loops grow their buffers through rt_reserve. The routines leave every register but rax as they
+// found it.
+static char *runtime =
+	"\n"
+	"section .bss\n"
+	"rt_free_lists resq 48\n"
+	"rt_heap_next resq 1\n"
+	"rt_heap_end resq 1\n"
+	"rt_out_buf resb 65536\n"
+	"rt_out_len resq 1\n"
+	"\n"
+	"section .text\n"
+	"; rax = block of at least rdi bytes\n"
+	"rt_alloc:\n"
+	"\tpush rcx\n"
+	"\tpush rdx\n"
+	"\tpush r8\n"
+	"\tlea rcx, [rdi+8]\n"
+	"\tmov rdx, 16\n"
+	"\txor r8, r8\n"
+	"rt_alloc_class:\n"
+	"\tcmp rdx, rcx\n"
+	"\tjae rt_alloc_found\n"
+	"\tshl rdx, 1\n"
+	"\tinc r8\n"
+	"\tjmp rt_alloc_class\n"
+	"rt_alloc_found:\n"
+	"\tmov rax, [rt_free_lists+r8*8]\n"
+	"\ttest rax, rax\n"
+	"\tjz rt_alloc_bump\n"
+	"\tmov rcx, [rax]\n"
+	"\tmov [rt_free_lists+r8*8], rcx\n"
+	"\tjmp rt_alloc_done\n"
+	"rt_alloc_bump:\n"
+	"\tmov rax, [rt_heap_next]\n"
+	"\tlea rcx, [rax+rdx]\n"
+	"\tcmp rcx, [rt_heap_end]\n"
+	"\tjbe rt_alloc_take\n"
+	"\tpush rsi\n"
+	"\tpush rdi\n"
+	"\tpush r9\n"
+	"\tpush r10\n"
+	"\tpush r11\n"
+	"\tmov rsi, 1048576\n"
+	"\tcmp rsi, rdx\n"
+	"\tjae rt_alloc_map\n"
+	"\tmov rsi, rdx\n"
+	"rt_alloc_map:\n"
+	"\tpush rdx\n"
+	"\tpush r8\n"
+	"\tpush rsi\n"
+	"\tmov rax, 9\n"
+	"\txor rdi, rdi\n"
+	"\tmov rdx, 3\n"
+	"\tmov r10, 34\n"
+	"\tmov r8, -1\n"
+	"\txor r9, r9\n"
+	"\tsyscall\n"
+	"\tpop rsi\n"
+	"\tpop r8\n"
+	"\tpop rdx\n"
+	"\tlea rcx, [rax+rsi]\n"
+	"\tmov [rt_heap_end], rcx\n"
+	"\tlea rcx, [rax+rdx]\n"
+	"\tpop r11\n"
+	"\tpop r10\n"
+	"\tpop r9\n"
+	"\tpop rdi\n"
+	"\tpop rsi\n"
+	"rt_alloc_take:\n"
+	"\tmov [rt_heap_next], rcx\n"
+	"\tmov [rax], r8\n"
+	"\tadd rax, 8\n"
+	"rt_alloc_done:\n"
+	"\tpop r8\n"
+	"\tpop rdx\n"
+	"\tpop rcx\n"
+	"\tret\n"
+	"\n"
+	"; makes room for rsi more bytes behind (rdx = 0) or in front of (rdx = 1) what the\n"
+	"; builder at rdi holds: base, capacity, start and end of its buffer\n"
+	"rt_reserve:\n"
+	"\ttest rdx, rdx\n"
+	"\tjnz rt_reserve_front\n"
+	"\tmov rax, [rdi+8]\n"
+	"\tsub rax, [rdi+24]\n"
+	"\tcmp rax, rsi\n"
+	"\tja rt_reserve_done\n"
+	"\tjmp rt_reserve_grow\n"
+	"rt_reserve_front:\n"
+	"\tcmp [rdi+16], rsi\n"
+	"\tja rt_reserve_done\n"
+	"rt_reserve_grow:\n"
+	"\tpush rcx\n"
+	"\tpush rdx\n"
+	"\tpush rsi\n"
+	"\tpush rdi\n"
+	"\tpush r8\n"
+	"\tpush r9\n"
+	"\tpush r10\n"
+	"\tmov r8, rdi\n"
+	"\tmov r9, [r8+24]\n"
+	"\tsub r9, [r8+16]\n"
+	"\tlea r10, [r9+rsi]\n"
+	"\tlea r10, [r10+r10+64]\n"
+	"\tlea rdi, [r10+1]\n"
+	"\tcall rt_alloc\n"
+	"\tmov rcx, r10\n"
+	"\tsub rcx, r9\n"
+	"\tsub rcx, rsi\n"
+	"\tshr rcx, 1\n"
+	"\ttest rdx, rdx\n"
+	"\tjz rt_reserve_copy\n"
+	"\tadd rcx, rsi\n"
+	"rt_reserve_copy:\n"
+	"\tlea rdi, [rax+rcx]\n"
+	"\tmov rsi, [r8]\n"
+	"\tadd rsi, [r8+16]\n"
+	"\tmov [r8+16], rcx\n"
+	"\tadd rcx, r9\n"
+	"\tmov [r8+24], rcx\n"
+	"\tmov rcx, r9\n"
+	"\trep movsb\n"
+	"\tmov rdi, [r8]\n"
+	"\tmov [r8], rax\n"
+	"\tmov [r8+8], r10\n"
+	"\ttest rdi, rdi\n"
+	"\tjz rt_reserve_restore\n"
+	"\tcall rt_free\n"
+	"rt_reserve_restore:\n"
+	"\tpop r10\n"
+	"\tpop r9\n"
+	"\tpop r8\n"
+	"\tpop rdi\n"
+	"\tpop rsi\n"
+	"\tpop rdx\n"
+	"\tpop rcx\n"
+	"rt_reserve_done:\n"
+	"\tret\n"
+	"\n"
+	"; puts the block at rdi back onto the list of its class\n"
+	"rt_free:\n"
+	"\tpush rcx\n"
+	"\tpush r8\n"
+	"\tmov r8, [rdi-8]\n"
+	"\tmov rcx, [rt_free_lists+r8*8]\n"
+	"\tmov [rdi], rcx\n"
+	"\tmov [rt_free_lists+r8*8], rdi\n"
+	"\tpop r8\n"
+	"\tpop rcx\n"
+	"\tret\n"
+	"\n"
+	"; makes room for rsi elements in the dynamic array whose pointer, length and capacity are at rdi,\n"
+	"; the capacity at least doubles so appending stays linear overall\n"
+	"rt_grow:\n"
+	"\tcmp [rdi+16], rsi\n"
+	"\tjae rt_grow_done\n"
+	"\tpush rcx\n"
+	"\tpush rsi\n"
+	"\tpush rdi\n"
+	"\tpush r8\n"
+	"\tmov r8, rdi\n"
+	"\tmov rcx, [r8+16]\n"
+	"\tshl rcx, 1\n"
+	"\tcmp rcx, rsi\n"
+	"\tjae rt_grow_min\n"
+	"\tmov rcx, rsi\n"
+	"rt_grow_min:\n"
+	"\tcmp rcx, 8\n"
+	"\tjae rt_grow_alloc\n"
+	"\tmov rcx, 8\n"
+	"rt_grow_alloc:\n"
+	"\tmov [r8+16], rcx\n"
+	"\tlea rdi, [rcx*8]\n"
+	"\tcall rt_alloc\n"
+	"\tmov rdi, rax\n"
+	"\tmov rsi, [r8]\n"
+	"\tmov rcx, [r8+8]\n"
+	"\trep movsq\n"
+	"\tmov rdi, [r8]\n"
+	"\tmov [r8], rax\n"
+	"\ttest rdi, rdi\n"
+	"\tjz rt_grow_restore\n"
+	"\tcall rt_free\n"
+	"rt_grow_restore:\n"
+	"\tpop r8\n"
+	"\tpop rdi\n"
+	"\tpop rsi\n"
+	"\tpop rcx\n"
+	"rt_grow_done:\n"
+	"\tret\n"
+	"\n"
+	"; appends the rdx elements at rsi to the dynamic array at rdi\n"
+	"rt_append:\n"
+	"\tpush rcx\n"
+	"\tpush rsi\n"
+	"\tpush rdi\n"
+	"\tpush rsi\n"
+	"\tmov rcx, [rdi]\n"
+	"\tmov rsi, [rdi+8]\n"
+	"\tadd rsi, rdx\n"
+	"\tcall rt_grow\n"
+	"\tpop rsi\n"
+	"\tcmp rsi, rcx\n"
+	"\tjne rt_append_copy\n"
+	"\tmov rsi, [rdi]\n"
+	"rt_append_copy:\n"
+	"\tmov rcx, [rdi+8]\n"
+	"\tlea rax, [rcx+rdx]\n"
+	"\tmov [rdi+8], rax\n"
+	"\tmov rdi, [rdi]\n"
+	"\tlea rdi, [rdi+rcx*8]\n"
+	"\tmov rcx, rdx\n"
+	"\trep movsq\n"
+	"\tpop rdi\n"
+	"\tpop rsi\n"
+	"\tpop rcx\n"
+	"\tret\n"
+	"\n"
+	"; gives the empty dynamic array at rdi esi zeroed elements, none if esi is negative\n"
+	"rt_fill:\n"
+	"\tpush rcx\n"
+	"\tpush rsi\n"
+	"\tpush rdi\n"
+	"\tmovsxd rsi, esi\n"
+	"\ttest rsi, rsi\n"
+	"\tjle rt_fill_done\n"
+	"\tcall rt_grow\n"
+	"\tmov [rdi+8], rsi\n"
+	"\tmov rcx, rsi\n"
+	"\tmov rdi, [rdi]\n"
+	"\txor eax, eax\n"
+	"\trep stosq\n"
+	"rt_fill_done:\n"
+	"\tpop rdi\n"
+	"\tpop rsi\n"
+	"\tpop rcx\n"
+	"\tret\n"
+	"\n"
+	"section .data\n"
+	"rt_pow10 dq 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000\n"
+	"rt_digit_pairs db \"00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899\"\n"
+	"\n"
+	"section .text\n"
+	"; writes the decimal digits of rax < 2^32 to rdi and leaves rdi behind them, changes rcx, rdx and r8\n"
+	"rt_utoa:\n"
+	"\tmov rcx, rax\n"
+	"\tor rcx, 1\n"
+	"\tmov r8, rcx\n"
+	"\tbsr rcx, rcx\n"
+	"\tinc rcx\n"
+	"\timul rcx, rcx, 1233\n"
+	"\tshr rcx, 12\n"
+	"\tcmp r8, [rt_pow10+rcx*8]\n"
+	"\tsbb rcx, -1\n"
+	"\tadd rdi, rcx\n"
+	"\tmov r8, rdi\n"
+	"rt_utoa_pairs:\n"
+	"\tcmp rax, 100\n"
+	"\tjb rt_utoa_last\n"
+	"\tmov rdx, rax\n"
+	"\timul rdx, rdx, 1374389535\n"
+	"\tshr rdx, 37\n"
+	"\timul rcx, rdx, 100\n"
+	"\tsub rax, rcx\n"
+	"\tmovzx ecx, word [rt_digit_pairs+rax*2]\n"
+	"\tsub r8, 2\n"
+	"\tmov [r8], cx\n"
+	"\tmov rax, rdx\n"
+	"\tjmp rt_utoa_pairs\n"
+	"rt_utoa_last:\n"
+	"\tcmp rax, 10\n"
+	"\tjb rt_utoa_one\n"
+	"\tmovzx ecx, word [rt_digit_pairs+rax*2]\n"
+	"\tmov [r8-2], cx\n"
+	"\tret\n"
+	"rt_utoa_one:\n"
+	"\tadd rax, 48\n"
+	"\tmov [r8-1], al\n"
+	"\tret\n"
+	"\n"
+	"; rax = the int in edi as a string of rdx characters\n"
+	"rt_itoa:\n"
+	"\tpush rcx\n"
+	"\tpush rdi\n"
+	"\tpush r8\n"
+	"\tpush r9\n"
+	"\tmov r9, rdi\n"
+	"\tmov rdi, 16\n"
+	"\tcall rt_alloc\n"
+	"\tpush rax\n"
+	"\tmov rdi, rax\n"
+	"\tmovsxd rax, r9d\n"
+	"\ttest rax, rax\n"
+	"\tjns rt_itoa_digits\n"
+	"\tneg rax\n"
+	"\tmov byte [rdi], 45\n"
+	"\tinc rdi\n"
+	"rt_itoa_digits:\n"
+	"\tcall rt_utoa\n"
+	"\tmov byte [rdi], 0\n"
+	"\tpop rax\n"
+	"\tmov rdx, rdi\n"
+	"\tsub rdx, rax\n"
+	"\tpop r9\n"
+	"\tpop r8\n"
+	"\tpop rdi\n"
+	"\tpop rcx\n"
+	"\tret\n"
+	"\n"
+	"; appends the int in edi to the output\n"
+	"rt_print_int:\n"
+	"\tpush rsi\n"
+	"\tpush rdi\n"
+	"\tpush r8\n"
+	"\tsub rsp, 16\n"
+	"\tmovsxd rax, edi\n"
+	"\tmov rdi, rsp\n"
+	"\ttest rax, rax\n"
+	"\tjns rt_print_int_digits\n"
+	"\tneg rax\n"
+	"\tmov byte [rdi], 45\n"
+	"\tinc rdi\n"
+	"rt_print_int_digits:\n"
+	"\tpush rcx\n"
+	"\tpush rdx\n"
+	"\tcall rt_utoa\n"
+	"\tpop rdx\n"
+	"\tpop rcx\n"
+	"\tmov rsi, rdi\n"
+	"\tlea rdi, [rsp]\n"
+	"\tsub rsi, rdi\n"
+	"\tcall rt_print\n"
+	"\tadd rsp, 16\n"
+	"\tpop r8\n"
+	"\tpop rdi\n"
+	"\tpop rsi\n"
+	"\tret\n"
+	"\n"
+	"; appends rsi bytes at rdi to the output, what doesn't fit into an empty buffer is written right away\n"
+	"rt_print:\n"
+	"\tpush rcx\n"
+	"\tpush rsi\n"
+	"\tpush rdi\n"
+	"\tmov rax, [rt_out_len]\n"
+	"\tadd rax, rsi\n"
+	"\tcmp rax, [rt_out_cap]\n"
+	"\tjbe rt_print_copy\n"
+	"\tcall rt_flush\n"
+	"\tcmp rsi, [rt_out_cap]\n"
+	"\tjbe rt_print_copy\n"
+	"\tpush rdx\n"
+	"\tpush r11\n"
+	"\tmov rdx, rsi\n"
+	"\tmov rsi, rdi\n"
+	"\tmov rax, 1\n"
+	"\tmov rdi, 1\n"
+	"\tsyscall\n"
+	"\tpop r11\n"
+	"\tpop rdx\n"
+	"\tjmp rt_print_done\n"
+	"rt_print_copy:\n"
+	"\tmov rcx, rsi\n"
+	"\tmov rsi, rdi\n"
+	"\tmov rdi, [rt_out_len]\n"
+	"\tadd [rt_out_len], rcx\n"
+	"\tlea rdi, [rt_out_buf+rdi]\n"
+	"\trep movsb\n"
+	"rt_print_done:\n"
+	"\tpop rdi\n"
+	"\tpop rsi\n"
+	"\tpop rcx\n"
+	"\tret\n"
+	"\n"
+	"; writes out and empties the output buffer\n"
+	"rt_flush:\n"
+	"\tpush rcx\n"
+	"\tpush rdx\n"
+	"\tpush rsi\n"
+	"\tpush rdi\n"
+	"\tpush r11\n"
+	"\tmov rdx, [rt_out_len]\n"
+	"\ttest rdx, rdx\n"
+	"\tjz rt_flush_done\n"
+	"\tmov rax, 1\n"
+	"\tmov rdi, 1\n"
+	"\tmov rsi, rt_out_buf\n"
+	"\tsyscall\n"
+	"\tmov qword [rt_out_len], 0\n"
+	"rt_flush_done:\n"
+	"\tpop r11\n"
+	"\tpop rdi\n"
+	"\tpop rsi\n"
+	"\tpop rdx\n"
+	"\tpop rcx\n"
+	"\tret\n";
+
 void gen(Node **funcs, size_t n_funcs)
 {
 	vregs_idx = MAX_REGISTER_COUNT; // 0 - MAX_REGISTER_COUNT for real regs
 
 	entrypoint_defined = 0;
 
+	frames = calloc(global_function_count, sizeof(Frame));
+
+	promoted = NULL;
+	promoted_func = NULL;
+	promoted_sz = 0;
+
+	hoisted = NULL;
+	hoisted_sz = 0;
+	hoist_groups = 0;
+
+	uses_runtime = 0;
+
+	builders = NULL;
+	builders_sz = 0;
+
+	begin_phase("emission");
 	for (int i = 0; i < n_funcs; i++) {
+		begin_function(funcs[i]->flabel);
 		emit_func_prologue(funcs[i]);
+		end_function();
 	}
+	end_phase();
 
 	if (!entrypoint_defined) {
 		c_error("No entrypoint was specified. Use keyword 'entry' in front of function to mark it as the entrypoint.", -1);
@@ -585,6 +1137,7 @@ void gen(Node **funcs, size_t n_funcs)
 		d_warning("Collision between -dps and -dlive. Liveness information won't be shown.");
 	}
 
+	begin_phase("output");
 	for (int i = 0; i < ins_array_sz; i++) {
 		char tmpbuf[128] = {0};
 		if (ins_array[i]->type >= MOV && ins_array[i]->type <= POP) {
@@ -625,8 +1178,20 @@ void gen(Node **funcs, size_t n_funcs)
 		outputbuf[outputbuf_sz] = '\0';
 	}
 
+	if (uses_runtime) {
+		// with no room in the buffer every print goes straight to write
+		char out_cap[64];
+		sprintf(out_cap, "\nsection .data\nrt_out_cap dq %d\n", no_buffered_output ? 0 : RT_OUT_SIZE);
+
+		outputbuf = realloc(outputbuf, outputbuf_sz + strlen(runtime) + strlen(out_cap) + 1);
+		strcpy(&outputbuf[outputbuf_sz], runtime);
+		strcat(&outputbuf[outputbuf_sz], out_cap);
+		outputbuf_sz += strlen(runtime) + strlen(out_cap);
+	}
+
 	fprintf(outputfp, outputbuf);
 	fclose(outputfp);
+	end_phase();
 }
 
 static void push(char *reg)
@@ -649,7 +1214,7 @@ static void emit_syscall(Node **args, size_t n_args)
 
 	char *regs[] = {"rdi", "rsi", "rdx", "r10", "r8", "r9"};
 
-	int func_returns[n_args-1];
+	int func_returns[n_args];
 
 	for (int i = 0; i < n_args; i++) {
 		if (args[i]->type == AST_FUNCTION_CALL) {
@@ -662,6 +1227,13 @@ static void emit_syscall(Node **args, size_t n_args)
 		}
 	}
 
+	// buffered prints go out first, so they stay in order with writes of the program itself,
+	// and exit and exit_group would lose them otherwise
+	if (args[0]->type != AST_INT || args[0]->ival == 1 || args[0]->ival == 18 || args[0]->ival == 20
+	    || args[0]->ival == 60 || args[0]->ival == 231) {
+		emit_runtime_call("rt_flush", 0);
+	}
+
 	for (int i = 0; i < n_args; i++) {
 		if (i == 0) {
 			emit_expr(args[i]);
@@ -687,11 +1259,26 @@ static void emit_syscall(Node **args, size_t n_args)
 	}
 
 	emit("syscall");
+	ins_array[ins_array_sz-1]->implicit_uses = REG_BIT(0);
+	ins_array[ins_array_sz-1]->implicit_defs = REG_BIT(0) | REG_BIT(2) | REG_BIT(9);
+	for (int i = 1; i < n_args; i++) {
+		ins_array[ins_array_sz-1]->implicit_uses |= REG_BIT(realRegToIdx(regs[i-1], &(char){0}));
+	}
 	emit("\n");
 
 	emit("mov v%d rax", vregs_idx);
 }
 
+static void emit_param_load(int word, int reg)
+{
+	if (word < N_ARG_REGS) {
+		emit("mov v%d %s", reg, Q_REGS[ARG_REGS[word]]);
+	} else {
+		// words that didn't fit into registers were pushed by the caller
+		emit("mov v%d [rbp+%d]", reg, 8 * (word - N_ARG_REGS + 2));
+	}
+}
+
 static void emit_func_prologue(Node *func)
 {
 	if (func->is_fn_entrypoint) {
@@ -705,50 +1292,61 @@ static void emit_func_prologue(Node *func)
 		emit_noindent("section .text");
 	}
 
+#define frame (frames[func->global_idx])
 	emit_noindent("global fn_%s", func->flabel);
 	emit_noindent("fn_%s:", func->flabel);
+	frame.label = ins_array[ins_array_sz-1];
 	push("rbp");
+	frame.push_rbp = ins_array[ins_array_sz-1];
 	emit("mov rbp rsp");
+	frame.set_rbp = ins_array[ins_array_sz-1];
+
+	if (!func->is_fn_entrypoint) {
+		frame.save_after = frame.set_rbp;
+	}
+
 	emit("\n");
 
 	int end_prologue = ins_array_sz;
 
 	stack_offset = 0;
-	int param_offset = 2;	// to account for pushed return address/pushed rbp
+	int word = 0;
 
-	for (int i = func->n_params-1; i >= 0; i--) {
+	for (int i = 0; i < func->n_params; i++) {
 		switch (func->fnparams[i]->lvar_valproppair->type)
 		{
 		case TYPE_STRING:
 			stack_offset += 16;
 
-			emit("mov v%d [rbp+%d]", vregs_idx, 8 * param_offset++);
-			emit("mov v%d [v%d]", vregs_idx, vregs_idx);
-			emit("mov [rsp+%d] vd%d", stack_offset, vregs_idx++);
-			emit("mov v%d [rbp+%d]", vregs_idx, 8 * param_offset++);
+			emit_param_load(word++, vregs_idx);
 			emit("mov [rsp+%d] v%d", stack_offset-8, vregs_idx++);
+			emit_param_load(word++, vregs_idx);
+			emit("mov [rsp+%d] v%d", stack_offset, vregs_idx++);
 
 			func->fnparams[i]->lvar_valproppair->loff = stack_offset;
 
 			break;
 		case TYPE_INT:
 		case TYPE_BOOL:
+		case TYPE_CHAR:
 			stack_offset += 8;
-
-			emit("mov vd%d [rbp+%d]", vregs_idx, 8 * param_offset++);
-			emit("mov [rsp+%d] vd%d", stack_offset, vregs_idx++);
-
 			func->fnparams[i]->lvar_valproppair->loff = stack_offset;
 
+			emit_param_load(word++, vregs_idx);
+			if (!promote(func->fnparams[i]->lvar_valproppair)) {
+				emit_store_offset(stack_offset, TYPE_INT);
+			}
+
 			break;
 		case TYPE_ARRAY:
 		{
 			stack_offset += 8;
-
-			emit("mov v%d [rbp+%d]", vregs_idx, 8 * param_offset++);
-			emit("mov [rsp+%d] v%d", stack_offset, vregs_idx++);
-
 			func->fnparams[i]->lvar_valproppair->loff = stack_offset;
+
+			emit_param_load(word++, vregs_idx);
+			if (!promote(func->fnparams[i]->lvar_valproppair)) {
+				emit("mov [rsp+%d] v%d", stack_offset, vregs_idx++);
+			}
 		}
 			break;
 		default:
@@ -756,9 +1354,23 @@ static void emit_func_prologue(Node *func)
 		}
 	}
 
+	frame.stack_params = word > N_ARG_REGS;
+
 	emit("\n");
 	emit_block(func->fnbody, func->n_stmts);
 
+	if (frame.tail_recursive) {
+		// self-recursive tail calls jump back here with fresh arguments in the argument registers
+		char *loop_label = malloc(20);
+		sprintf(loop_label, "tailrec_%d:", func->global_idx);
+
+		ins_array = realloc(ins_array, sizeof(MnemNode*) * (ins_array_sz+1));
+		memmove(&ins_array[end_prologue+1], &ins_array[end_prologue], sizeof(MnemNode*) * (ins_array_sz-end_prologue));
+		ins_array_sz++;
+
+		ins_array[end_prologue] = makeMnemNode(loop_label);
+	}
+
 	ins_array = realloc(ins_array, sizeof(MnemNode*) * (ins_array_sz+1));
 	memmove(&ins_array[end_prologue+1], &ins_array[end_prologue], sizeof(MnemNode*) * (ins_array_sz-end_prologue));
 
@@ -774,6 +1386,12 @@ static void emit_func_prologue(Node *func)
 	sub->right = makeMnemNode(numVarsStr);
 
 	ins_array[end_prologue] = sub;
+	frame.sub_rsp = sub;
+	frame.size = stack_offset;
+
+	for (int i = 0; i < frame.n_tail_calls; i++) {
+		frame.tail_add_rsp[i]->right = makeMnemNode(numVarsStr);
+	}
 
 	if (func->return_type == TYPE_VOID) {
 		emit("mov rax 0");
@@ -782,20 +1400,35 @@ static void emit_func_prologue(Node *func)
 	emit("\n");
 	emit_noindent("ret_%d:", current_func);
 	emit("add rsp %d", stack_offset);
+	frame.add_rsp = ins_array[ins_array_sz-1];
 
 	func->end_body = ins_array_sz;
 	func->start_body = end_prologue - 1;
 
 	emit("pop rbp");
+	frame.pop_rbp = ins_array[ins_array_sz-1];
+
+	if (!func->is_fn_entrypoint) {
+		frame.restore_before = frame.pop_rbp;
+	}
+
 	emit("\n");
 
 	if (func->is_fn_entrypoint) {
+		emit_runtime_call("rt_flush", 0);
 		emit("mov rax 60");
 		emit("mov rdi 0");
 		emit("syscall");
+		ins_array[ins_array_sz-1]->implicit_uses = REG_BIT(0) | REG_BIT(5);
 	} else {
 		emit("ret");
+		// the return value is read by the caller
+		ins_array[ins_array_sz-1]->implicit_uses = REG_BIT(0);
+		if (func->return_type == TYPE_STRING) {
+			ins_array[ins_array_sz-1]->implicit_uses |= REG_BIT(3);
+		}
 	}
+#undef frame
 }
 
 static void emit_block(Node **block, size_t sz)
@@ -814,7 +1447,6 @@ static void emit_store_offset(int offset, int type)
 			break;
 		case TYPE_STRING:
 			emit("mov [rsp+%d] v%d", offset-8, vregs_idx-2);
-			emit("mov v%d [v%d]", vregs_idx-1, vregs_idx-1);
 			emit("mov [rsp+%d] v%d", offset, vregs_idx-1);
 			emit("\n");
 			break;
@@ -823,6 +1455,35 @@ static void emit_store_offset(int offset, int type)
 	}
 }
 
+// scalars and the pointers array parameters are passed as live in a virtual register of their own, taken from the current vregs_idx so
+// a pending initial value becomes the variable; the stack slot stays reserved in case
+// the allocator runs out of registers and has to put it back
+static int promote(ValPropPair *pair)
+{
+	if (pair->home || (pair->type != TYPE_INT && pair->type != TYPE_BOOL && pair->type != TYPE_CHAR
+	    && !(pair->type == TYPE_ARRAY && pair->is_array_reference))) {
+		return 0;
+	}
+
+	pair->home = vregs_idx++;
+
+	promoted = realloc(promoted, sizeof(ValPropPair *) * (promoted_sz+1));
+	promoted_func = realloc(promoted_func, sizeof(int) * (promoted_sz+1));
+	promoted[promoted_sz] = pair;
+	promoted_func[promoted_sz++] = current_func;
+
+	return 1;
+}
+
+static void emit_store_var(ValPropPair *pair, int type)
+{
+	if (pair->home) {
+		emit("mov vd%d vd%d", pair->home, vregs_idx++);
+	} else {
+		emit_store_offset(pair->loff, type);
+	}
+}
+
 static void emit_store(Node *n)
 {
 	switch (n->type)
@@ -836,7 +1497,9 @@ static void emit_store(Node *n)
 					stack_offset += 8;
 					n->lvar_valproppair->loff = stack_offset;
 
-					emit_store_offset(stack_offset, TYPE_INT);
+					if (!promote(n->lvar_valproppair)) {
+						emit_store_offset(stack_offset, TYPE_INT);
+					}
 					break;
 				case TYPE_STRING:
 					stack_offset += 16;
@@ -852,7 +1515,7 @@ static void emit_store(Node *n)
 			{
 				case TYPE_INT:
 				default:
-					emit_store_offset(off, TYPE_INT);
+					emit_store_var(n->lvar_valproppair, TYPE_INT);
 					break;
 				case TYPE_STRING:
 					emit_store_offset(off, TYPE_STRING);
@@ -861,27 +1524,11 @@ static void emit_store(Node *n)
 			break;
 		case AST_IDX_ARRAY:
 		{
-			ValPropPair *ref_array = n->lvar_valproppair->ref_array;
 			int to_store = vregs_idx++;
 
-			int offset_reg = vregs_idx++;
-			emit("mov vd%d 0", offset_reg);
-			for (int i = 0; i < n->ndim_index; i++) {
-				int sizeacc = 1;
-				for (int j = i+1; j < ref_array->array_dims; j++) {
-					sizeacc *= ref_array->array_size[j];
-				}
-
-				emit_expr(n->index_values[i]);
-
-				emit("lea vd%d [vd%d*%d]", vregs_idx, vregs_idx, sizeacc);
-				emit("add vd%d vd%d", offset_reg, vregs_idx);
-			}
-
-			emit("lea vd%d [vd%d*8]", offset_reg, offset_reg);
-			emit("sub rsp v%d", offset_reg);
-			emit("mov [rsp+%d] v%d", ref_array->loff, to_store);
-			emit("add rsp v%d", offset_reg);
+			char addr[64];
+			emit_element_address(n, n->lvar_valproppair->ref_array, addr);
+			emit("mov %s v%d", addr, to_store);
 
 			vregs_idx++;
 		}
@@ -894,6 +1541,10 @@ static void emit_store(Node *n)
 
 static void emit_assign(Node *n)
 {
+	if (emit_builder_extension(n)) {
+		return;
+	}
+
 	if (n->left->lvar_valproppair->type == TYPE_ARRAY) {
 		emit_expr(n->left);
 		emit_array_assign(n->left, n->right);
@@ -910,6 +1561,11 @@ static int emit_array_assign(Node *var, Node *array)
 #define pair (var->lvar_valproppair)
 	//emit_expr(var);
 
+	if (is_dynamic(pair)) {
+		emit_dynamic_assign(pair, array);
+		return 0;
+	}
+
 	if (array->type == AST_ARRAY || array->type == AST_IDENT || array->type == AST_IDX_ARRAY || array->type == AST_FUNCTION_CALL) {
 		if (var->type == AST_IDX_ARRAY) {
 			return emit_offset_assign(pair->ref_array->array_dims, pair->ref_array->array_size, &pair->ref_array->array_len, &pair->ref_array->array_elems, pair->loff, array);
@@ -936,7 +1592,15 @@ static int emit_offset_assign(int array_dims, int *array_size, size_t *array_len
 	} else if (array->type == AST_FUNCTION_CALL) {
 		emit_func_call(array);
 		int arr_reg = vregs_idx++;
-		for (int i = 0; i < array_size[0]+1; i++) {
+
+		// whole vectors first, the slots that don't fill one are moved one by one
+		int i = 0;
+		for (; i + VECTOR_LANES <= array_size[0]+1; i += VECTOR_LANES) {
+			int last = i + VECTOR_LANES-1;
+			emit("%s %s0 [v%d-%d]", avx2 ? "vmovdqu" : "movdqu", avx2 ? "ymm" : "xmm", arr_reg, last*8);
+			emit("%s [rsp+%d] %s0", avx2 ? "vmovdqu" : "movdqu", loff-(last*8), avx2 ? "ymm" : "xmm");
+		}
+		for (; i < array_size[0]+1; i++) {
 			emit("mov v%d [v%d-%d]", vregs_idx, arr_reg, i*8);
 			emit("mov qword [rsp+%d] v%d", loff-(i*8), vregs_idx++);
 		}
@@ -962,9 +1626,11 @@ static int emit_offset_assign(int array_dims, int *array_size, size_t *array_len
 			acc *= array_size[j];
 		}
 
-		for (int i = 0; i < member_sz; i++) {
-			emit("mov qword [rsp+%d] %d", members[i][1]+(loff-members[0][1]), members[i][0]);
+		if (member_sz && !emit_rodata_copy(array, members, member_sz, loff-members[0][1])) {
+			emit_array_members(members, member_sz, loff-members[0][1]);
+		}
 
+		for (int i = 0; i < member_sz; i++) {
 			if (counter < acc) {
 				counter++;
 			} else {
@@ -1002,6 +1668,113 @@ static int emit_offset_assign(int array_dims, int *array_size, size_t *array_len
 	}
 }
 
+// stores the constant members of an array, runs of one value covering whole vectors are stored
+// a vector at a time
+static void emit_array_members(int **members, size_t member_sz, int base)
+{
+	for (int i = 0; i < member_sz;) {
+		int run = 1;
+		while (i+run < member_sz && members[i+run][0] == members[i][0] && members[i+run][1] == members[i][1] - run*8) {
+			run++;
+		}
+
+		// anything but zero has to be moved into a vector register first, that only pays off for two stores
+		int vectors = run / VECTOR_LANES;
+		if (vectors >= (members[i][0] ? 2 : 1)) {
+			if (members[i][0] == 0) {
+				emit("%s", avx2 ? "vpxor ymm0 ymm0,ymm0" : "pxor xmm0 xmm0");
+			} else {
+				emit("mov v%d %d", vregs_idx, members[i][0]);
+				if (avx2) {
+					emit("vmovq xmm0 v%d", vregs_idx++);
+					emit("vpbroadcastq ymm0 xmm0");
+				} else {
+					emit("movq xmm0 v%d", vregs_idx++);
+					emit("punpcklqdq xmm0 xmm0");
+				}
+			}
+
+			for (int k = 0; k < vectors; k++) {
+				i += VECTOR_LANES;
+				emit("%s [rsp+%d] %s0", avx2 ? "vmovdqu" : "movdqu", base+members[i-1][1], avx2 ? "ymm" : "xmm");
+			}
+			run -= vectors * VECTOR_LANES;
+		}
+
+		for (; run > 0; run--, i++) {
+			emit("mov qword [rsp+%d] %d", base+members[i][1], members[i][0]);
+		}
+	}
+}
+
+// puts the members of a constant literal into .rodata once, laid out as on the stack with the first
+// member highest and the length below the last, NULL if they don't fill consecutive slots
+static char *emit_rodata_array(Node *array, int **members, size_t member_sz)
+{
+	for (int i = 1; i < member_sz; i++) {
+		if (members[i][1] != members[0][1] - i*8) {
+			return NULL;
+		}
+	}
+
+	if (!array->alabel) {
+		array->alabel = makeLabel(0);
+
+		emit("\n");
+		emit_noindent("section .rodata");
+		emit("%s dq %ld", array->alabel, array->array_size);
+		for (int i = member_sz-1; i >= 0; i -= 3) {
+			if (i >= 2) {
+				emit("dq %d, %d, %d", members[i][0], members[i-1][0], members[i-2][0]);
+			} else if (i == 1) {
+				emit("dq %d, %d", members[1][0], members[0][0]);
+			} else {
+				emit("dq %d", members[0][0]);
+			}
+		}
+		emit("\n");
+		emit_noindent("section .text");
+	}
+
+	return array->alabel;
+}
+
+// copies a long constant literal from .rodata instead of storing its members one at a time,
+// 0 if it is stored the usual way
+static int emit_rodata_copy(Node *array, int **members, size_t member_sz, int base)
+{
+	if (array->type != AST_ARRAY || member_sz < RODATA_MIN_MEMBERS) {
+		return 0;
+	}
+
+	char *label = emit_rodata_array(array, members, member_sz);
+	if (label == NULL) {
+		return 0;
+	}
+
+	int low = base + members[member_sz-1][1];
+
+	if (member_sz >= REP_MOVS_MIN_MEMBERS) {
+		emit("lea rdi [rsp+%d]", low);
+		emit("lea rsi [%s+8]", label);
+		emit("mov rcx %ld", member_sz);
+		emit_movsq();
+		return 1;
+	}
+
+	int i = 0;
+	for (; i + VECTOR_LANES <= member_sz; i += VECTOR_LANES) {
+		emit("%s %s0 [%s+%d]", avx2 ? "vmovdqu" : "movdqu", avx2 ? "ymm" : "xmm", label, 8+i*8);
+		emit("%s [rsp+%d] %s0", avx2 ? "vmovdqu" : "movdqu", low+i*8, avx2 ? "ymm" : "xmm");
+	}
+	for (; i < member_sz; i++) {
+		emit("mov v%d [%s+%d]", vregs_idx, label, 8+i*8);
+		emit("mov [rsp+%d] v%d", low+i*8, vregs_idx++);
+	}
+
+	return 1;
+}
+
 static int **getArrayMembers(Node *array, size_t *n_members, int total_size, int last_size, int *n_iter, size_t offset)
 {
 	int **members = NULL;
@@ -1117,7 +1890,7 @@ static int do_array_arithmetic(Node *expr, Node *var)
 		} else {
 			emit("\n");
 			emit("mov vd%d [rsp+%d]", vregs_idx, pair->loff - (pair->array_size[0] * 8));
-			emit("lea vd%d [vd%d*8]", vregs_idx, vregs_idx);
+			emit("neg v%d", vregs_idx);
 
 			int offset_reg = vregs_idx++;
 
@@ -1129,13 +1902,11 @@ static int do_array_arithmetic(Node *expr, Node *var)
 
 			emit("\n");
 
-			emit("sub rsp v%d", offset_reg);
-
-			emit_store_offset(pair->loff, TYPE_INT);
-
-			emit("add rsp v%d", offset_reg);
+			emit("mov [rsp+%d+v%d*8] vd%d", pair->loff, offset_reg, vregs_idx++);
 
 
+			// appends emitted more than once, e.g. in an unrolled loop, outgrow the declared elements
+			pair->array_elems = realloc(pair->array_elems, sizeof(Node *) * (pair->array_len+1));
 			pair->array_elems[pair->array_len++] = expr->right;
 
 			emit("inc qword [rsp+%d]", pair->loff - (pair->array_size[0] * 8));
@@ -1155,6 +1926,169 @@ static int do_array_arithmetic(Node *expr, Node *var)
 	}
 }
 
+// Dynamic arrays keep their pointer, length and capacity in a header at loff-16, loff-8 and loff,
+// parameters hold its address instead. The elements lie upwards from the pointer in a block from the
+// runtime heap that rt_grow replaces when it's full, each fills its whole 8-byte slot.
+static int is_dynamic(ValPropPair *pair)
+{
+	return pair->type == TYPE_ARRAY && pair->array_dims == 1 && pair->array_size[0] < 0;
+}
+
+// such functions hand over the pointer and length of the array in rax and rdx, like a string
+static int returns_dynamic(Node *func)
+{
+	Node *ret = func->return_stmt;
+	return func->ret_array_dims && ret && ret->retval && ret->retval->type == AST_IDENT && is_dynamic(ret->retval->lvar_valproppair);
+}
+
+static int is_dynamic_call(Node *n)
+{
+	return n->type == AST_FUNCTION_CALL && n->global_function_idx >= 0 && returns_dynamic(global_functions[n->global_function_idx]);
+}
+
+// an empty header in the frame for an array no variable holds, returns the register with its address
+static int emit_dynamic_temp()
+{
+	stack_offset += 24;
+	for (int i = 0; i < 3; i++) {
+		emit("mov qword [rsp+%d] 0", stack_offset-i*8);
+	}
+	emit("lea v%d [rsp+%d]", vregs_idx, stack_offset-16);
+	return vregs_idx++;
+}
+
+typedef struct {
+	ValPropPair *array;
+	int uses;
+} ArrayUses;
+
+static void count_uses(Node *n, void *data)
+{
+	ArrayUses *u = data;
+	if (n->type == AST_IDENT && n->lvar_valproppair == u->array) {
+		u->uses++;
+	}
+}
+
+// a = x + y + ..., every operand is an array or element appended to what the ones before it gave
+static void emit_dynamic_assign(ValPropPair *pair, Node *expr)
+{
+	Node *first = expr;
+	while (first->type == AST_ADD) {
+		first = first->left;
+	}
+
+	ArrayUses u = {pair, 0};
+	visit_block(&expr, 1, count_uses, &u);
+
+	int header;
+	if (first->type == AST_IDENT && first->lvar_valproppair == pair && u.uses == 1) {
+		// a = a + ..., appends in place
+		emit_array_base(pair, vregs_idx);
+		header = vregs_idx++;
+		emit_dynamic_operands(header, expr, first);
+	} else if (u.uses) {
+		// the array is read on the right, so the result is built up in a header of its own first
+		int temp = emit_dynamic_temp();
+		emit_dynamic_operands(temp, expr, NULL);
+		emit_array_base(pair, vregs_idx);
+		header = vregs_idx++;
+		for (int i = 0; i < 3; i++) {
+			emit("mov v%d [v%d+%d]", vregs_idx, temp, i*8);
+			emit("mov [v%d+%d] v%d", header, i*8, vregs_idx++);
+		}
+	} else {
+		emit_array_base(pair, vregs_idx);
+		header = vregs_idx++;
+		emit("mov qword [v%d+8] 0", header);
+		emit_dynamic_operands(header, expr, NULL);
+	}
+}
+
+// appends the operands of the '+' chain in expr in order, leaving out skip
+static void emit_dynamic_operands(int header, Node *expr, Node *skip)
+{
+	if (expr == skip) {
+		return;
+	} else if (expr->type == AST_ADD) {
+		emit_dynamic_operands(header, expr->left, skip);
+		emit_dynamic_append(header, expr->right);
+	} else {
+		emit_dynamic_append(header, expr);
+	}
+}
+
+// appends the elements of a dynamic array, or one element or the members of an array literal,
+// whose room is checked only once, to the array whose header is in register header
+static void emit_dynamic_append(int header, Node *value)
+{
+	if ((value->type == AST_IDENT && value->lvar_valproppair->type == TYPE_ARRAY) || is_dynamic_call(value)) {
+		int ptr, len;
+		if (value->type == AST_IDENT) {
+			if (!is_dynamic(value->lvar_valproppair)) {
+				c_error("Only dynamic arrays can be appended to dynamic arrays.", -1);
+			}
+			int source = vregs_idx++;
+			emit_array_base(value->lvar_valproppair, source);
+			ptr = vregs_idx++;
+			len = vregs_idx++;
+			emit("mov v%d [v%d]", ptr, source);
+			emit("mov v%d [v%d+8]", len, source);
+		} else {
+			emit_expr(value);
+			ptr = vregs_idx-2;
+			len = vregs_idx-1;
+		}
+
+		emit("mov rdi v%d", header);
+		emit("mov rsi v%d", ptr);
+		emit("mov rdx v%d", len);
+		emit_runtime_call("rt_append", REG_BIT(3) | REG_BIT(4) | REG_BIT(5));
+		return;
+	}
+
+	size_t n = 1;
+	Node **elems = &value;
+	if (value->type == AST_ARRAY) {
+		n = value->array_size;
+		elems = value->array_elems;
+	}
+
+	if (!n) {
+		return;
+	}
+
+	int *vals = malloc(sizeof(int) * n);
+	for (int i = 0; i < n; i++) {
+		emit_expr(elems[i]);
+		vals[i] = vregs_idx++;
+	}
+
+	char *fits_label = makeLabel(0);
+	int len = vregs_idx++;
+	int room = vregs_idx++;
+	int ptr = vregs_idx++;
+
+	emit("mov v%d [v%d+8]", len, header);
+	emit("mov v%d [v%d+16]", room, header);
+	emit("sub v%d %ld", room, n);
+	emit("cmp v%d v%d", len, room);
+	emit("jle %s", fits_label);
+	emit("mov rdi v%d", header);
+	emit("lea rsi [v%d+%ld]", len, n);
+	emit_runtime_call("rt_grow", REG_BIT(4) | REG_BIT(5));
+	emit_noindent("%s:", fits_label);
+
+	emit("mov v%d [v%d]", ptr, header);
+	for (int i = 0; i < n; i++) {
+		emit("mov [v%d%+d+v%d*8] v%d", ptr, i*8, len, vals[i]);
+	}
+	emit("add v%d %ld", len, n);
+	emit("mov [v%d+8] v%d", header, len);
+
+	free(vals);
+}
+
 static int *getArraySizes(Node *array, int dims)
 {
 	int *sizes = malloc(dims * sizeof(int));
@@ -1193,9 +2127,7 @@ static void emit_literal(Node *expr)
 				emit_noindent("section .text");
 			}
 			emit("mov v%d %s", vregs_idx++, expr->slabel);
-			stack_offset += 8;
-			emit("mov qword [rsp+%d] %d", stack_offset, expr->slen);
-			emit("lea v%d [rsp+%d]", vregs_idx++, stack_offset);
+			emit("mov v%d %d", vregs_idx++, expr->slen);
 			break;
 		case AST_ARRAY:
 		{
@@ -1224,12 +2156,87 @@ static void emit_literal(Node *expr)
 	}
 }
 
-static void emit_array_arg(Node *n)
+// nothing stores into a parameter that's never assigned to, indexed on the left of '=', returned
+// or passed on
+static void find_param_writes(Node *n, void *data)
+{
+	ParamWrites *w = data;
+	if (n->type >= AST_ASSIGN && n->type <= AST_MOD_ASSIGN) {
+		if ((n->left->type == AST_IDENT && !strcmp(n->left->name, w->name))
+		    || (n->left->type == AST_IDX_ARRAY && !strcmp(n->left->ia_label, w->name))) {
+			w->written = 1;
+		}
+	} else if (n->type == AST_FUNCTION_CALL && !find_intrinsic(n)) {
+		for (int i = 0; i < n->n_args; i++) {
+			if (n->callargs[i]->type == AST_IDENT && !strcmp(n->callargs[i]->name, w->name)) {
+				w->written = 1;
+			}
+		}
+	} else if (n->type == AST_RETURN_STMT && n->retval && n->retval->type == AST_IDENT && !strcmp(n->retval->name, w->name)) {
+		w->written = 1;
+	}
+}
+
+static int param_is_readonly(Node *func, int i)
+{
+	ParamWrites w = {func->fnparams[i]->vlabel, 0};
+	visit_block(func->fnbody, func->n_stmts, find_param_writes, &w);
+	return !w.written;
+}
+
+// the .rodata copy of a constant literal of exactly the shape of param, NULL if there is none
+static char *readonly_literal(Node *array, ValPropPair *param)
+{
+	if (array->array_dims != param->array_dims) {
+		return NULL;
+	}
+
+	int *sizes = getArraySizes(array, array->array_dims);
+	int total_size = 1;
+	for (int i = 0; i < array->array_dims; i++) {
+		if (sizes[i] != param->array_size[i]) {
+			return NULL;
+		}
+		total_size *= sizes[i];
+	}
+
+	size_t member_sz = 0;
+	int iter = 0;
+	int **members = getArrayMembers(array, &member_sz, total_size, sizes[array->array_dims-1], &iter, total_size * 8);
+	if (member_sz != total_size) {
+		return NULL;
+	}
+
+	return emit_rodata_array(array, members, member_sz);
+}
+
+// arrays are passed as the address of their first element, see emit_element_address, dynamic ones
+// as that of their header
+static void emit_array_arg(Node *n, Node *func, int param)
 {
+	if (is_dynamic(func->fnparams[param]->lvar_valproppair) && n->type != AST_IDENT) {
+		// a literal or returned array is put into a header of its own first
+		int header = emit_dynamic_temp();
+		emit_dynamic_append(header, n);
+		emit("mov v%d v%d", vregs_idx, header);
+		return;
+	}
+
 	switch (n->type)
 	{
 	case AST_ARRAY:
 	{
+		// a function that only reads the parameter is handed the literal where it lies in .rodata
+		char *label;
+		if (param_is_readonly(func, param) && (label = readonly_literal(n, func->fnparams[param]->lvar_valproppair))) {
+			int total_size = 1;
+			for (int i = 0; i < n->array_dims; i++) {
+				total_size *= func->fnparams[param]->lvar_valproppair->array_size[i];
+			}
+			emit("lea v%d [%s+%d]", vregs_idx, label, total_size*8);
+			break;
+		}
+
 		Node *var = malloc(sizeof(Node));
 		int *array_size = getArraySizes(n, n->array_dims);
 
@@ -1251,7 +2258,7 @@ static void emit_array_arg(Node *n)
 	}
 		break;
 	case AST_IDENT:
-		emit("lea v%d [rsp+%d]", vregs_idx, n->lvar_valproppair->loff);
+		emit_array_base(n->lvar_valproppair, vregs_idx);
 		break;
 	case AST_FUNCTION_CALL:
 		emit_func_call(n);
@@ -1261,28 +2268,96 @@ static void emit_array_arg(Node *n)
 	}
 }
 
-static void emit_idx_array(Node *n)
+// multiplies an index by a constant stride, using lea where the stride allows it
+static void emit_scale(int reg, int stride)
 {
-	ValPropPair *ref_array = n->lvar_valproppair->ref_array;
+	switch (stride)
+	{
+		case 1:
+			break;
+		case 2:
+		case 4:
+		case 8:
+			emit("lea vd%d [vd%d*%d]", reg, reg, stride);
+			break;
+		case 3:
+		case 5:
+		case 9:
+			emit("lea vd%d [vd%d+vd%d*%d]", reg, reg, reg, stride-1);
+			break;
+		default:
+			emit("imul vd%d %d", reg, stride);
+			break;
+	}
+}
 
-	int offset_reg = vregs_idx++;
-	emit("mov vd%d 0", offset_reg);
+// writes the x86 operand addressing the element n refers to into addr
+static void emit_element_address(Node *n, ValPropPair *ref_array, char *addr)
+{
+	int offset_reg = -1;
+	int const_idx = 0;
 	for (int i = 0; i < n->ndim_index; i++) {
 		int sizeacc = 1;
 		for (int j = i+1; j < ref_array->array_dims; j++) {
 			sizeacc *= ref_array->array_size[j];
 		}
 
-		emit_expr(n->index_values[i]);
+		Node *idx = n->index_values[i];
+		if (idx->type == AST_INT) {
+			const_idx += idx->ival * sizeacc;
+			continue;
+		} else if (idx->type == AST_ADD && idx->right->type == AST_INT) {
+			const_idx += idx->right->ival * sizeacc;
+			idx = idx->left;
+		}
+
+		emit_expr(idx);
+		int reg = vregs_idx++;
+		emit_scale(reg, sizeacc);
+
+		if (offset_reg < 0) {
+			offset_reg = reg;
+		} else {
+			emit("add vd%d vd%d", offset_reg, reg);
+		}
+	}
+
+	if (offset_reg >= 0 && !is_dynamic(ref_array)) {
+		emit("neg v%d", offset_reg);
+	}
+
+	// elements are laid out downwards from loff, or from the address stored there for parameters,
+	// those of dynamic arrays upwards from their pointer
+	char index[24] = "";
+	if (offset_reg >= 0) {
+		sprintf(index, "+v%d*8", offset_reg);
+	}
+	if (is_dynamic(ref_array)) {
+		emit_array_base(ref_array, vregs_idx);
+		emit("mov v%d [v%d]", vregs_idx+1, vregs_idx);
+		vregs_idx++;
+		sprintf(addr, "[v%d%+d%s]", vregs_idx++, const_idx*8, index);
+	} else if (ref_array->is_array_reference) {
+		emit_array_base(ref_array, vregs_idx);
+		sprintf(addr, "[v%d%+d%s]", vregs_idx++, -const_idx*8, index);
+	} else {
+		sprintf(addr, "[rsp+%d%s]", ref_array->loff - const_idx*8, index);
+	}
+}
 
-		emit("lea vd%d [vd%d*%d]", vregs_idx, vregs_idx, sizeacc);
-		emit("add vd%d vd%d", offset_reg, vregs_idx);
+static void emit_idx_array(Node *n)
+{
+	if (n->lvar_valproppair->type == TYPE_CHAR) {
+		int string = vregs_idx++;
+		emit("mov v%d [rsp+%d]", string, n->lvar_valproppair->ref_array->loff-8);
+		emit_expr(n->index_values[0]);
+		emit("movzx vd%d byte [v%d+v%d]", vregs_idx, string, vregs_idx);
+		return;
 	}
 
-	emit("lea vd%d [vd%d*8]", offset_reg, offset_reg);
-	emit("sub rsp v%d", offset_reg);
-	emit("mov vd%d [rsp+%d]", vregs_idx, ref_array->loff);
-	emit("add rsp v%d", offset_reg);
+	char addr[64];
+	emit_element_address(n, n->lvar_valproppair->ref_array, addr);
+	emit("mov vd%d %s", vregs_idx, addr);
 }
 
 static void emit_load(int offset, char *base, int type)
@@ -1291,7 +2366,7 @@ static void emit_load(int offset, char *base, int type)
 	{
 		case TYPE_STRING:
 			emit("mov v%d [%s+%d]", vregs_idx++, base, offset-8);
-			emit("lea v%d [%s+%d]", vregs_idx++, base, offset);
+			emit("mov v%d [%s+%d]", vregs_idx++, base, offset);
 			break;
 		case TYPE_INT:
 		default:
@@ -1305,9 +2380,17 @@ static void emit_lvar(Node *n)
 	switch (n->lvar_valproppair->type)
 	{
 		case AST_ARRAY:
-			emit("lea v%d [rsp+%d]", vregs_idx, n->lvar_valproppair->loff);
+			emit_array_base(n->lvar_valproppair, vregs_idx);
 			break;
 		case AST_INT:
+		case AST_BOOL:
+		case TYPE_CHAR:
+			if (n->lvar_valproppair->home) {
+				emit("mov vd%d vd%d", vregs_idx, n->lvar_valproppair->home);
+			} else {
+				emit_load(n->lvar_valproppair->loff, "rsp", n->lvar_valproppair->type);
+			}
+			break;
 		case AST_STRING:
 			emit_load(n->lvar_valproppair->loff, "rsp", n->lvar_valproppair->type);
 			break;
@@ -1316,9 +2399,24 @@ static void emit_lvar(Node *n)
 	}
 }
 
-static void emit_declaration(Node *n)
+// the address of the first element of a fixed-size array or of the header of a dynamic one,
+// parameters hold it instead of the array
+static void emit_array_base(ValPropPair *pair, int reg)
 {
-	switch (n->lvar_valproppair->type)
+	if (pair->home) {
+		emit("mov v%d v%d", reg, pair->home);
+	} else if (pair->is_array_reference) {
+		emit("mov v%d [rsp+%d]", reg, pair->loff);
+	} else if (is_dynamic(pair)) {
+		emit("lea v%d [rsp+%d]", reg, pair->loff-16);
+	} else {
+		emit("lea v%d [rsp+%d]", reg, pair->loff);
+	}
+}
+
+static void emit_declaration(Node *n)
+{
+	switch (n->lvar_valproppair->type)
 	{
 		case TYPE_STRING:
 			stack_offset += 16;
@@ -1327,21 +2425,26 @@ static void emit_declaration(Node *n)
 			break;
 		case TYPE_ARRAY:
 		{
-			if (!n->lvar_valproppair->loff) {
+			if (is_dynamic(n->lvar_valproppair)) {
+				stack_offset += 24;
+				n->lvar_valproppair->loff = stack_offset;
+				for (int i = 0; i < 3; i++) {
+					emit("mov qword [rsp+%d] 0", stack_offset-i*8);
+				}
+
+				if (n->varray_len) {
+					emit_expr(n->varray_len);
+					emit("mov rsi v%d", vregs_idx++);
+					emit("lea rdi [rsp+%d]", stack_offset-16);
+					emit_runtime_call("rt_fill", REG_BIT(4) | REG_BIT(5));
+				}
+			} else if (!n->lvar_valproppair->loff) {
 				int acc = 1;
-				int i;
-				for (i = 0; i < n->v_array_dimensions; i++) {
-					if (n->varray_size[i] < 0) {
-						break;
-					}
+				for (int i = 0; i < n->v_array_dimensions; i++) {
 					acc *= n->varray_size[i];
 				}
-				if (i != n->v_array_dimensions) {
-					c_error("Not implemented.", -1);
-				} else {
-					stack_offset += 8 * (acc+1);	// +1 for array_len
-					n->lvar_valproppair->loff = stack_offset;
-				}
+				stack_offset += 8 * (acc+1);	// +1 for array_len
+				n->lvar_valproppair->loff = stack_offset;
 			}
 		}
 			break;
@@ -1349,8 +2452,83 @@ static void emit_declaration(Node *n)
 		default:
 			stack_offset += 8;
 			n->lvar_valproppair->loff = stack_offset;
+			promote(n->lvar_valproppair);
+
+			break;
+	}
+}
+
+// x * c with a shift or lea where c allows it, 0 if a plain imul is needed
+static int emit_const_mul(Node *x, int c)
+{
+	if (c & (c-1)) {
+		if (c != 3 && c != 5 && c != 9) {
+			return 0;
+		}
+
+		emit_expr(x);
+		emit("lea vd%d [vd%d+vd%d*%d]", vregs_idx, vregs_idx, vregs_idx, c-1);
+		return 1;
+	}
+
+	emit_expr(x);
+	if (c > 1) {
+		emit("shl vd%d %d", vregs_idx, __builtin_ctz(c));
+	}
+	return 1;
+}
+
+// unsigned x / d or x % d without div: x / d == (x * m) >> p for a suitable m
+static void emit_const_div(int x, unsigned int d, int mod)
+{
+	if (!(d & (d-1))) {
+		emit("mov vd%d vd%d", vregs_idx, x);
+		if (mod) {
+			emit("and vd%d %u", vregs_idx, d-1);
+		} else if (d > 1) {
+			emit("shr vd%d %d", vregs_idx, __builtin_ctz(d));
+		}
+		return;
+	}
 
+	// the rounding error of m must stay below 1/d for every 32-bit x
+	int p;
+	unsigned long m;
+	for (p = 32; ; p++) {
+		m = ((1UL << p) + d - 1) / d;
+		if (m * d - (1UL << p) <= (1UL << (p-32))) {
 			break;
+		}
+	}
+
+	int q = mod ? vregs_idx++ : vregs_idx;
+	if (m < (1UL << 31)) {
+		emit("mov vd%d vd%d", q, x);
+		emit("imul v%d %lu", q, m);
+		emit("shr v%d %d", q, p);
+	} else if (m < (1UL << 32)) {
+		int m_reg = vregs_idx++;
+		q = mod ? q : vregs_idx;
+		emit("mov v%d %lu", m_reg, m);
+		emit("mov vd%d vd%d", q, x);
+		emit("imul v%d v%d", q, m_reg);
+		emit("shr v%d %d", q, p);
+	} else {
+		// m takes 33 bits, x * m is done as x * (m - 2^32) + x * 2^32
+		int m_reg = vregs_idx++;
+		q = mod ? q : vregs_idx;
+		emit("mov v%d %lu", m_reg, m - (1UL << 32));
+		emit("mov vd%d vd%d", q, x);
+		emit("imul v%d v%d", q, m_reg);
+		emit("shr v%d 32", q);
+		emit("add v%d v%d", q, x);
+		emit("shr v%d %d", q, p-32);
+	}
+
+	if (mod) {
+		emit("imul vd%d %u", q, d);
+		emit("mov vd%d vd%d", vregs_idx, x);
+		emit("sub vd%d vd%d", vregs_idx, q);
 	}
 }
 
@@ -1382,6 +2560,12 @@ static void emit_int_arith_binop(Node *expr)
 			break;
 		case AST_MUL:
 		case AST_MUL_ASSIGN:
+			if (expr->right->type == AST_INT && expr->right->ival > 0 && emit_const_mul(expr->left, expr->right->ival)) {
+				break;
+			} else if (expr->left->type == AST_INT && expr->left->ival > 0 && emit_const_mul(expr->right, expr->left->ival)) {
+				break;
+			}
+
 			emit_expr(expr->left);
 			left_idx = vregs_idx++;
 			emit_expr(expr->right);
@@ -1393,6 +2577,11 @@ static void emit_int_arith_binop(Node *expr)
 		case AST_DIV_ASSIGN:
 			emit_expr(expr->left);
 			left_idx = vregs_idx++;
+
+			if (expr->right->type == AST_INT && expr->right->ival > 0) {
+				emit_const_div(left_idx, expr->right->ival, 0);
+				break;
+			}
 			emit_expr(expr->right);
 			right_idx = vregs_idx;
 
@@ -1408,6 +2597,11 @@ static void emit_int_arith_binop(Node *expr)
 		case AST_MOD_ASSIGN:
 			emit_expr(expr->left);
 			left_idx = vregs_idx++;
+
+			if (expr->right->type == AST_INT && expr->right->ival > 0) {
+				emit_const_div(left_idx, expr->right->ival, 1);
+				break;
+			}
 			emit_expr(expr->right);
 			right_idx = vregs_idx;
 
@@ -1454,97 +2648,186 @@ static size_t *emit_string_assign(Node *var, Node *string)
 	}
 }
 
+static int is_char(Node *n)
+{
+	return n && (n->type == AST_IDENT || n->type == AST_IDX_ARRAY) && n->lvar_valproppair->type == TYPE_CHAR;
+}
+
+// leaves a string operand in the two registers in front of vregs_idx, a char leaves its byte in
+// the first one and a length of 1 in the second, returns the length known at compile time
+static size_t emit_string_piece(Node *n)
+{
+	if (is_char(n)) {
+		emit_expr(n);
+		vregs_idx++;
+		emit("mov v%d 1", vregs_idx++);
+		return 1;
+	}
+
+	return emit_string_assign(NULL, n)[0];
+}
+
+// copies what emit_string_piece left for n to dst+at, or to dst if at < 0
+static void emit_piece_copy(Node *n, int piece, int len, int dst, int at)
+{
+	if (is_char(n)) {
+		if (at < 0) {
+			emit("mov [v%d] vb%d", dst, piece);
+		} else {
+			emit("mov [v%d+v%d] vb%d", dst, at, piece);
+		}
+		return;
+	}
+
+	emit("mov rsi v%d", piece);
+	if (at < 0) {
+		emit("mov rdi v%d", dst);
+	} else {
+		emit("lea rdi [v%d+v%d]", dst, at);
+	}
+	emit("mov rcx v%d", len);
+	emit_movsb();
+}
+
 static size_t emit_string_arith_binop(Node *expr)
 {
-	size_t *string1_pair = emit_string_assign(NULL, expr->left);
-	size_t string1_len = string1_pair[0];
+	size_t string1_len = emit_string_piece(expr->left);
 	int string1 = vregs_idx-2;
-	int string1_end = vregs_idx-1;
+	int len1 = vregs_idx-1;
 
-	size_t *string2_pair = emit_string_assign(NULL, expr->right);
-	size_t string2_len = string2_pair[0];
+	size_t string2_len = emit_string_piece(expr->right);
 	int string2 = vregs_idx-2;
-	int string2_end = vregs_idx-1;
-
-	char *buf1 = makeLabel(0);
-	char *buf2 = makeLabel(0);
-
-	char *copyBuf2 = makeLabel(0);
-	char *copyBuf1 = makeLabel(0);
-	char *loop1 = makeLabel(0);
-	char *loop2 = makeLabel(0);
-	char *cont_label1 = makeLabel(0);
-	char *cont_label2 = makeLabel(0);
-
-	int idx_reg = vregs_idx++;
-	int idx2_reg = vregs_idx++;
-	int c_reg = vregs_idx++;
-	int buf1_reg = vregs_idx++;
-	int buf2_reg = vregs_idx++;
-
-	emit_noindent("section .bss");
-	emit("%s resb %d", buf1, 100/*new_len+1*/);
-	emit("%s resb %d", buf2, 100/*new_len+1*/);
-	emit_noindent("section .text");
-
-	emit("mov v%d %s", buf2_reg, buf2);
-	emit("mov v%d 0", idx_reg);
-
-	emit("cmp qword [v%d] 0", string2_end);
-	emit("je %s", cont_label1);
-
-	emit_noindent("%s:", copyBuf2);
-	emit("mov vb%d [v%d+v%d]", c_reg, string2, idx_reg);
-	emit("mov [v%d+v%d] vb%d", buf2_reg, idx_reg, c_reg);
-	emit("\n");
-	emit("inc v%d", idx_reg);
-	emit("cmp v%d [v%d]", idx_reg, string2_end);
-	emit("jl %s", copyBuf2);
-	emit("\n");
+	int len2 = vregs_idx-1;
 
-	emit_noindent("%s:", cont_label1);
+	int total = vregs_idx++;
+	int buf_reg = vregs_idx++;
 
-	emit("mov v%d %s", buf1_reg, buf1);
-	emit("mov v%d 0", idx_reg);
+	emit("lea v%d [v%d+v%d]", total, len1, len2);
 
-	emit("cmp qword [v%d] 0", string1_end);
-	emit("je %s", cont_label2);
-	emit_noindent("%s:", loop1);
-	emit("mov vb%d [v%d+v%d]", c_reg, string1, idx_reg);
-	emit("mov [v%d+v%d] vb%d", buf1_reg, idx_reg, c_reg);
-	emit("\n");
-	emit("inc v%d", idx_reg);
-	emit("inc qword [v%d]", string2_end);
-	emit("cmp v%d [v%d]", idx_reg, string1_end);
-	emit("jl %s", loop1);
-	emit("\n");
+	// every result gets storage of its own, with room for a terminating zero for syscalls
+	emit("lea rdi [v%d+1]", total);
+	emit_runtime_call("rt_alloc", REG_BIT(5));
+	emit("mov v%d rax", buf_reg);
+	emit("mov byte [v%d+v%d] 0", buf_reg, total);
+
+	emit_piece_copy(expr->left, string1, len1, buf_reg, -1);
+	emit_piece_copy(expr->right, string2, len2, buf_reg, len1);
 
-	emit_noindent("%s:", cont_label2);
+	// results of nested '+' can't be referenced anywhere else, their blocks are reused right away
+	if (expr->left->type == AST_ADD) {
+		emit("mov rdi v%d", string1);
+		emit_runtime_call("rt_free", REG_BIT(5));
+	}
+	if (expr->right->type == AST_ADD) {
+		emit("mov rdi v%d", string2);
+		emit_runtime_call("rt_free", REG_BIT(5));
+	}
 
-	emit("mov v%d %s", buf2_reg, buf2);
-	emit("mov v%d 0", idx2_reg);
+	emit("mov v%d v%d", vregs_idx++, buf_reg);
+	emit("mov v%d v%d", vregs_idx++, total);
 
-	emit_noindent("%s:", loop2);
-	emit("mov vb%d [v%d+v%d]", c_reg, buf2_reg, idx2_reg);
-	emit("mov [v%d+v%d] vb%d", buf1_reg, idx_reg, c_reg);
-	emit("\n");
-	emit("inc v%d", idx_reg);
-	emit("inc v%d", idx2_reg);
-	emit("cmp v%d [v%d]", idx_reg, string2_end);
-	emit("jl %s", loop2);
+	return string1_len + string2_len;
+}
 
-	emit("mov v%d 0", idx_reg);
+// calls a routine of the runtime appended to the program, rax is all it changes
+static void emit_runtime_call(char *routine, int arg_regs)
+{
+	emit("call %s", routine);
+	ins_array[ins_array_sz-1]->implicit_uses = arg_regs;
+	ins_array[ins_array_sz-1]->implicit_defs = REG_BIT(0);
+	uses_runtime = 1;
+}
 
-	emit_noindent("%s:", copyBuf1);
-	emit("mov vb%d [v%d+v%d]", c_reg, buf1_reg, idx_reg);
-	emit("mov [v%d+v%d] vb%d", buf2_reg, idx_reg, c_reg);
-	emit("\n");
-	emit("inc v%d", idx_reg);
-	emit("cmp v%d [v%d]", idx_reg, string2_end);
-	emit("jl %s", copyBuf1);
+// arrays keep the number of their top-level elements behind the last one, dynamic ones in their header
+static void emit_array_len(ValPropPair *pair)
+{
+	if (is_dynamic(pair)) {
+		emit_array_base(pair, vregs_idx);
+		emit("mov vd%d [v%d+8]", vregs_idx+1, vregs_idx);
+		vregs_idx++;
+		return;
+	}
+
+	int total_size = 1;
+	for (int i = 0; i < pair->array_dims; i++) {
+		total_size *= pair->array_size[i];
+	}
+
+	if (pair->is_array_reference) {
+		emit_array_base(pair, vregs_idx);
+		emit("mov vd%d [v%d-%d]", vregs_idx+1, vregs_idx, total_size*8);
+		vregs_idx++;
+	} else {
+		emit("mov vd%d [rsp+%d]", vregs_idx, pair->loff-total_size*8);
+	}
+}
+
+static void emit_intrinsic(Node *n)
+{
+	if (find_intrinsic(n) == INTRINSIC_RANGE) {
+		c_error("range() can only be iterated over by a for loop.", -1);
+	}
+
+	if (find_intrinsic(n) == INTRINSIC_LEN && n->callargs[0]->type == AST_IDENT
+	    && n->callargs[0]->lvar_valproppair->type == TYPE_ARRAY) {
+		emit_array_len(n->callargs[0]->lvar_valproppair);
+		return;
+	}
+
+	if (n->n_args) {
+		emit_expr(n->callargs[0]);
+	}
 
-	emit("mov v%d %s", vregs_idx++, buf2);
-	emit("mov v%d v%d", vregs_idx++, string2_end);
+	switch (find_intrinsic(n))
+	{
+		case INTRINSIC_LEN:
+			emit("mov vd%d vd%d", vregs_idx, vregs_idx-1);
+			break;
+		case INTRINSIC_INT_TO_STR:
+			emit("mov rdi v%d", vregs_idx++);
+			emit_runtime_call("rt_itoa", REG_BIT(5));
+			ins_array[ins_array_sz-1]->implicit_defs |= REG_BIT(3);
+			emit("mov v%d rax", vregs_idx++);
+			emit("mov v%d rdx", vregs_idx++);
+			break;
+		case INTRINSIC_PRINT_INT:
+			emit("mov rdi v%d", vregs_idx++);
+			emit_runtime_call("rt_print_int", REG_BIT(5));
+			break;
+		case INTRINSIC_PRINT_STRING:
+			emit("mov rdi v%d", vregs_idx-2);
+			emit("mov rsi v%d", vregs_idx-1);
+			emit_runtime_call("rt_print", REG_BIT(4) | REG_BIT(5));
+			break;
+		case INTRINSIC_FLUSH:
+			emit_runtime_call("rt_flush", 0);
+			break;
+	}
+}
+
+// copies rcx bytes from rsi to rdi
+static void emit_movsb()
+{
+	emit("rep movsb");
+	ins_array[ins_array_sz-1]->implicit_uses = REG_BIT(2) | REG_BIT(4) | REG_BIT(5);
+	ins_array[ins_array_sz-1]->implicit_defs = REG_BIT(2) | REG_BIT(4) | REG_BIT(5);
+}
+
+static void emit_movsq()
+{
+	emit("rep movsq");
+	ins_array[ins_array_sz-1]->implicit_uses = REG_BIT(2) | REG_BIT(4) | REG_BIT(5);
+	ins_array[ins_array_sz-1]->implicit_defs = REG_BIT(2) | REG_BIT(4) | REG_BIT(5);
+}
+
+// a one-character string literal compared with a char stands for its byte
+static void emit_comp_operand(Node *n, Node *other)
+{
+	if (n->type == AST_STRING && is_char(other)) {
+		emit("mov vd%d %d", vregs_idx, (unsigned char) n->sval[1]);
+	} else {
+		emit_expr(n);
+	}
 }
 
 static void emit_comp_binop(Node *expr)
@@ -1564,10 +2847,10 @@ static void emit_comp_binop(Node *expr)
 			emit("cmp vd%d 1", vregs_idx++);
 			emit("jne %s", false_label);
 		} else {
-			emit_expr(expr->left);
+			emit_comp_operand(expr->left, expr->right);
 			int l_idx = vregs_idx;
 			vregs_idx++;
-			emit_expr(expr->right);
+			emit_comp_operand(expr->right, expr->left);
 
 			emit("cmp vd%d vd%d", l_idx, vregs_idx++);
 
@@ -1623,6 +2906,9 @@ static void op(Node *expr)
 	case AST_MUL_ASSIGN:
 	case AST_DIV_ASSIGN:
 	case AST_MOD_ASSIGN:
+		if (emit_builder_extension(expr)) {
+			break;
+		}
 		if (expr->result_type == TYPE_INT) {
 			emit_int_arith_binop(expr);
 		}
@@ -1646,100 +2932,137 @@ static void op(Node *expr)
 	}
 }
 
+// evaluates every argument before any argument register is written, returns the number of words
+static int emit_call_args(Node *n, int *words)
+{
+#define func (global_functions[n->global_function_idx])
+	int n_words = 0;
+
+	int arg_type;
+	for (int i = 0; i < n->n_args; i++) {
+		switch (n->callargs[i]->type)
+		{
+		case AST_INT:
+		case AST_BOOL:
+		case AST_STRING:
+		case AST_ARRAY:
+			arg_type = n->callargs[i]->type;
+			break;
+		case AST_IDENT:
+		case AST_IDX_ARRAY:
+			arg_type = n->callargs[i]->lvar_valproppair->type;
+			break;
+		case AST_ADD:
+		case AST_SUB:
+		case AST_MUL:
+		case AST_DIV:
+		case AST_MOD:
+		case AST_GT:
+		case AST_LT:
+		case AST_EQ:
+		case AST_NE:
+		case AST_GE:
+		case AST_LE:
+			arg_type = n->callargs[i]->result_type;
+			break;
+		case AST_FUNCTION_CALL:
+			if(global_functions[n->callargs[i]->global_function_idx]->ret_array_dims) {
+				arg_type = AST_ARRAY;
+			} else {
+				arg_type = global_functions[n->callargs[i]->global_function_idx]->return_type;
+			}
+			break;
+		}
+
+		if (arg_type == AST_ARRAY) {
+			emit_array_arg(n->callargs[i], func, i);
+		} else {
+			emit_expr(n->callargs[i]);
+		}
+
+		switch (arg_type)
+		{
+		case AST_INT:
+		case AST_BOOL:
+		case AST_ARRAY:
+		case TYPE_CHAR:
+			words[n_words++] = vregs_idx++;
+			break;
+		case AST_STRING:
+		{
+			// strings are passed as (pointer, length)
+			words[n_words++] = vregs_idx-2;
+			words[n_words++] = vregs_idx-1;
+
+			size_t *pair = malloc(sizeof(size_t) * 2);
+			getStringLens(n->callargs[i], pair);
+
+			func->fnparams[i]->lvar_valproppair->slen = pair[0];
+			func->fnparams[i]->lvar_valproppair->s_allocated = pair[1];
+		}
+			break;
+		default:
+			c_error("Not implemented.", -1);
+		}
+	}
+
+	return n_words;
+#undef func
+}
+
 static void emit_func_call(Node *n)
 {
 	int idx = n->global_function_idx;
 
-	int real_params = 0;
-
 	if (idx < 0) {
 		emit_syscall(n->callargs, n->n_args);
+	} else if (find_intrinsic(n)) {
+		emit_intrinsic(n);
 	} else {
 #define func (global_functions[idx])
-		int arg_type;
-		for (int i = 0; i < n->n_args; i++) {
-			switch (n->callargs[i]->type)
-			{
-			case AST_INT:
-			case AST_STRING:
-			case AST_ARRAY:
-				arg_type = n->callargs[i]->type;
-				break;
-			case AST_IDENT:
-				arg_type = n->callargs[i]->lvar_valproppair->type;
-				break;
-			case AST_ADD:
-			case AST_SUB:
-			case AST_MUL:
-			case AST_DIV:
-			case AST_MOD:
-			case AST_GT:
-			case AST_LT:
-			case AST_EQ:
-			case AST_NE:
-			case AST_GE:
-			case AST_LE:
-				arg_type = n->callargs[i]->result_type;
-				break;
-			case AST_FUNCTION_CALL:
-				if(global_functions[n->callargs[i]->global_function_idx]->ret_array_dims) {
-					arg_type = AST_ARRAY;
-				} else {
-					arg_type = global_functions[n->callargs[i]->global_function_idx]->return_type;
-				}
-				break;
-			}
-
-			if (arg_type == AST_ARRAY) {
-				emit_array_arg(n->callargs[i]);
-			} else {
-				emit_expr(n->callargs[i]);
-			}
-
-			switch (arg_type)
-			{
-			case AST_INT:
-			case AST_ARRAY:
-				emit("push v%d", vregs_idx++);
-				real_params++;
-				break;
-			case AST_STRING:
-			{
-				emit("push v%d", vregs_idx-2);
-				emit("push v%d", vregs_idx-1);
+		int words[n->n_args * 2];
+		int n_words = emit_call_args(n, words);
 
-				size_t *pair = malloc(sizeof(size_t) * 2);
-				getStringLens(n->callargs[i], pair);
-
-				func->fnparams[i]->lvar_valproppair->slen = pair[0];
-				func->fnparams[i]->lvar_valproppair->s_allocated = pair[1];
+		int stack_words = 0;
+		for (int i = n_words-1; i >= N_ARG_REGS; i--) {
+			emit("push v%d", words[i]);
+			stack_words++;
+		}
 
-				real_params += 2;
-			}
-				break;
-			default:
-				c_error("Not implemented.", -1);
-			}
+		int arg_regs = 0;
+		for (int i = 0; i < n_words && i < N_ARG_REGS; i++) {
+			emit("mov %s v%d", Q_REGS[ARG_REGS[i]], words[i]);
+			arg_regs |= REG_BIT(ARG_REGS[i]);
 		}
 
 		emit("call fn_%s", func->flabel);
+		ins_array[ins_array_sz-1]->implicit_uses = arg_regs;
+		ins_array[ins_array_sz-1]->implicit_defs = CALLER_SAVED_MASK;
 
 		func->called_to = realloc(func->called_to, sizeof(int)*(func->n_called_to+1));
 		func->called_to[func->n_called_to++] = ins_array_sz;
 
-		emit("add rsp %d", real_params*8);	// clean up the stack
+		if (stack_words) {
+			emit("add rsp %d", stack_words*8);	// clean up the stack
+		}
+
+		if (returns_dynamic(func)) {
+			emit("mov v%d rax", vregs_idx++);
+			emit("mov v%d rdx", vregs_idx++);
+			return;
+		}
 
 		switch (func->return_type)
 		{
 			case TYPE_INT:
+			case TYPE_BOOL:
+			case TYPE_CHAR:
 			case TYPE_ARRAY:
 				emit("mov v%d rax", vregs_idx);
 				break;
 			case TYPE_STRING:
-				stack_offset += 8;
 				emit("mov v%d rax", vregs_idx++);
-				emit("mov [rsp+%d] rbx", stack_offset, vregs_idx);
-				emit("lea v%d [rsp+%d]", vregs_idx++, stack_offset);
+				emit("mov v%d rdx", vregs_idx++);
 				break;
 			default:
 				break;
@@ -1768,71 +3091,377 @@ static void emit_if(Node *n)
 	emit_noindent("%s:", cont_label);
 }
 
-static void emit_while(Node *n)
+// String builders
+
+// what gets put in front of (*front = 1) or behind 's' by 's = s + x', 's = x + s' or 's += x', NULL for anything else
+static Node *extension_piece(Node *n, int *front)
 {
-	char *cond_label = makeLabel(0);
-	char *body_label = makeLabel(1);
+	if ((n->type != AST_ASSIGN && n->type != AST_ADD_ASSIGN) || n->left->type != AST_IDENT
+	    || n->left->lvar_valproppair->type != TYPE_STRING) {
+		return NULL;
+	}
 
-	emit("jmp %s", cond_label);
+	char *name = n->left->name;
+	Node *piece = NULL;
+	*front = 0;
+
+	if (n->type == AST_ADD_ASSIGN) {
+		piece = n->right;
+	} else if (n->right->type == AST_ADD) {
+		Node *l = n->right->left;
+		Node *r = n->right->right;
+		if (l->type == AST_IDENT && !strcmp(l->name, name)) {
+			piece = r;
+		} else if (r->type == AST_IDENT && !strcmp(r->name, name)) {
+			piece = l;
+			*front = 1;
+		}
+	}
 
-	emit_noindent("%s:", body_label);
-	emit_block(n->while_body, n->n_while_stmts);
+	// 's = s + s' reads the string it's building
+	int mentions = 0;
+	Extensions ext = {&name, &(int){0}, &mentions, &(int){0}, 1};
+	if (piece) {
+		visit_block(&piece, 1, count_mentions, &ext);
+	}
 
-	emit_noindent("%s:", cond_label);
-	emit_comp_binop(n->while_cond);
-	emit("cmp vd%d 1", vregs_idx++);
-	emit("je %s", body_label);
+	return mentions ? NULL : piece;
 }
 
-static void emit_for(Node *n)
+static void find_extensions(Node *n, void *data)
 {
-#define for_enum (n->for_enum)
-#define for_it (n->for_iterator)
-
-	int enum_off;
-
-	int *sizes;
+	Extensions *ext = data;
+	int front;
+	if (!extension_piece(n, &front)) {
+		return;
+	}
 
-	if (for_enum->type == AST_IDENT || for_enum->type == AST_STRING) {
-		if (for_enum->type == AST_IDENT) {
-			if (for_enum->lvar_valproppair->type != TYPE_STRING) {
-				enum_off = for_enum->lvar_valproppair->loff;
-				sizes = for_enum->lvar_valproppair->array_size;
+	int i;
+	for (i = 0; i < ext->n && strcmp(ext->names[i], n->left->name); i++);
+	if (i == ext->n) {
+		ext->names = realloc(ext->names, sizeof(char *) * (ext->n+1));
+		ext->expected = realloc(ext->expected, sizeof(int) * (ext->n+1));
+		ext->mentions = realloc(ext->mentions, sizeof(int) * (ext->n+1));
+		ext->loff = realloc(ext->loff, sizeof(int) * (ext->n+1));
+		ext->names[i] = n->left->name;
+		ext->expected[i] = 0;
+		ext->mentions[i] = 0;
+		ext->loff[i] = n->left->lvar_valproppair->loff;
+		ext->n++;
+	}
+	ext->expected[i] += n->type == AST_ADD_ASSIGN ? 1 : 2;
+}
 
-				goto cont_nostring;
-			}
+// a declaration in the loop starts the string over on every iteration, so it counts as well
+static void count_mentions(Node *n, void *data)
+{
+	Extensions *ext = data;
+	for (int i = 0; i < ext->n; i++) {
+		if ((n->type == AST_IDENT && !strcmp(n->name, ext->names[i]))
+		    || (n->type == AST_DECLARATION && !strcmp(n->vlabel, ext->names[i]))
+		    || (n->type == AST_IDX_ARRAY && !strcmp(n->ia_label, ext->names[i]))) {
+			ext->mentions[i]++;
 		}
+	}
+}
 
-		char *loop_label = makeLabel(1);
-		int acc = vregs_idx++;
+// extends the buffer of b by the piece in the two registers in front of vregs_idx, see emit_string_piece
+static void emit_builder_add(Builder *b, Node *piece, int front)
+{
+	int ptr = vregs_idx-2;
+	int len = vregs_idx-1;
+
+	emit("lea rdi [rsp+%d]", b->state);
+	emit("mov rsi v%d", len);
+	emit("mov rdx %d", front);
+	emit_runtime_call("rt_reserve", REG_BIT(3) | REG_BIT(4) | REG_BIT(5));
+
+	int base = vregs_idx++;
+	int at = vregs_idx++;
+	emit("mov v%d [rsp+%d]", base, b->state);
+	if (front) {
+		emit("mov v%d [rsp+%d]", at, b->state+16);
+		emit("sub v%d v%d", at, len);
+		emit("mov [rsp+%d] v%d", b->state+16, at);
+	} else {
+		emit("mov v%d [rsp+%d]", at, b->state+24);
+		emit("lea v%d [v%d+v%d]", vregs_idx, at, len);
+		emit("mov [rsp+%d] v%d", b->state+24, vregs_idx++);
+	}
 
-		emit_expr(for_enum);
-		int string = vregs_idx-2;
-		int len = vregs_idx-1;
+	emit_piece_copy(piece, ptr, len, base, at);
+}
 
-		emit("mov v%d [v%d]", len, len);
+// appends or prepends in place if n extends a string that is being built, returns 1 if it did
+static int emit_builder_extension(Node *n)
+{
+	int front;
+	Node *piece = extension_piece(n, &front);
+	if (!piece) {
+		return 0;
+	}
 
-		emit_declaration(for_it);
+	for (int i = 0; i < builders_sz; i++) {
+		if (!strcmp(builders[i].name, n->left->name)) {
+			emit_string_piece(piece);
+			emit_builder_add(&builders[i], piece, front);
+			return 1;
+		}
+	}
 
-		emit("mov vd%d 0", acc);
-		emit_noindent("%s:", loop_label);
+	return 0;
+}
 
-		emit("mov vb%d [v%d+v%d]", vregs_idx, string, acc);
+// strings a loop does nothing with but append or prepend to are built in a buffer that grows by
+// doubling and only become a string again once the loop is done
+static void emit_loop(Node *n)
+{
+	Extensions ext = {NULL, NULL, NULL, NULL, 0};
+	visit_block(&n, 1, find_extensions, &ext);
+	visit_block(&n, 1, count_mentions, &ext);
 
-		stack_offset += 10;
-		emit("mov [rsp+%d] vb%d", stack_offset, vregs_idx);
-		emit("mov byte [rsp+%d] 0", stack_offset+1);
-		emit("lea v%d [rsp+%d]", vregs_idx++, stack_offset);
-		emit("mov qword [rsp+%d] 1", stack_offset+2);
-		emit("lea v%d [rsp+%d]", vregs_idx++, stack_offset+2);
+	size_t outer = builders_sz;
+	for (int i = 0; i < ext.n; i++) {
+		int j;
+		for (j = 0; j < builders_sz && strcmp(builders[j].name, ext.names[i]); j++);
+		if (j < builders_sz || ext.mentions[i] != ext.expected[i]) {
+			continue;
+		}
 
-		emit_store_offset(for_it->lvar_valproppair->loff, for_it->vtype);
+		stack_offset += 32;
+		builders = realloc(builders, sizeof(Builder) * (builders_sz+1));
+		Builder *b = &builders[builders_sz++];
+		b->name = ext.names[i];
+		b->state = stack_offset-24;
+		b->loff = ext.loff[i];
 
-		emit_block(n->for_body, n->n_for_stmts);
+		for (int k = 0; k < 4; k++) {
+			emit("mov qword [rsp+%d] 0", b->state + k*8);
+		}
+		emit_load(b->loff, "rsp", TYPE_STRING);
+		emit_builder_add(b, NULL, 0);
+	}
+
+	if (n->type == AST_WHILE_STMT) {
+		emit_while(n);
+	} else {
+		emit_for(n);
+	}
+
+	for (int i = outer; i < builders_sz; i++) {
+		Builder *b = &builders[i];
+		int base = vregs_idx++;
+		int start = vregs_idx++;
+		int end = vregs_idx++;
+		emit("mov v%d [rsp+%d]", base, b->state);
+		emit("mov v%d [rsp+%d]", start, b->state+16);
+		emit("mov v%d [rsp+%d]", end, b->state+24);
+		emit("mov byte [v%d+v%d] 0", base, end);
+		emit("sub v%d v%d", end, start);
+		emit("lea v%d [v%d+v%d]", start, base, start);
+		emit("mov [rsp+%d] v%d", b->loff-8, start);
+		emit("mov [rsp+%d] v%d", b->loff, end);
+	}
+	builders_sz = outer;
+
+	free(ext.names);
+	free(ext.expected);
+	free(ext.mentions);
+	free(ext.loff);
+}
+
+static void emit_while(Node *n)
+{
+	char *cond_label = makeLabel(0);
+	char *body_label = makeLabel(1);
+
+	emit("jmp %s", cond_label);
+
+	emit_noindent("%s:", body_label);
+	emit_block(n->while_body, n->n_while_stmts);
+
+	emit_noindent("%s:", cond_label);
+	emit_comp_binop(n->while_cond);
+	emit("cmp vd%d 1", vregs_idx++);
+	emit("je %s", body_label);
+}
+
+// adds the first n - n % VECTOR_LANES elements of the array at p to sum, p is left pointing at the rest
+static void emit_vector_sum(Node *sum, int p, int n)
+{
+	char *loop_label = makeLabel(1);
+	int end = vregs_idx++;
+
+	emit("lea v%d [v%d-%d]", end, p, n / VECTOR_LANES * VECTOR_LANES * 8);
+
+	// only the even dwords hold elements, the odd ones are the upper halves of their slots
+	if (avx2) {
+		emit("vpxor ymm0 ymm0,ymm0");
+		emit_noindent("%s:", loop_label);
+		emit("vmovdqu ymm1 [v%d-%d]", p, (VECTOR_LANES-1)*8);
+		emit("vpaddd ymm0 ymm0,ymm1");
+	} else {
+		emit("pxor xmm0 xmm0");
+		emit_noindent("%s:", loop_label);
+		emit("movdqu xmm1 [v%d-%d]", p, (VECTOR_LANES-1)*8);
+		emit("paddd xmm0 xmm1");
+	}
+	emit("sub v%d %d", p, VECTOR_LANES*8);
+	emit("cmp v%d v%d", p, end);
+	emit("jne %s", loop_label);
+
+	stack_offset += 8;
+	if (avx2) {
+		emit("vextracti128 xmm1 ymm0,1");
+		emit("vpaddd xmm0 xmm0,xmm1");
+		emit("vpsrldq xmm1 xmm0,8");
+		emit("vpaddd xmm0 xmm0,xmm1");
+		emit("vmovd [rsp+%d] xmm0", stack_offset);
+	} else {
+		emit("movdqa xmm1 xmm0");
+		emit("psrldq xmm1 8");
+		emit("paddd xmm0 xmm1");
+		emit("movd [rsp+%d] xmm0", stack_offset);
+	}
+
+	emit_expr(sum);
+	int acc = vregs_idx++;
+	emit("mov vd%d [rsp+%d]", vregs_idx, stack_offset);
+	emit("add vd%d vd%d", vregs_idx, acc);
+	emit_store(sum);
+}
+
+// 'for (int i : range(start, end))' counts from start up to but excluding end in a register of its own
+static void emit_range_for(Node *n)
+{
+	char *loop_label = makeLabel(1);
+	char *end_label = makeLabel(0);
+
+	emit_expr(n->for_enum->callargs[0]);
+	int i = vregs_idx++;
+	emit_expr(n->for_enum->callargs[1]);
+	int end = vregs_idx++;
+
+	emit_declaration(n->for_iterator);
+
+	emit("cmp vd%d vd%d", i, end);
+	emit("jge %s", end_label);
+	emit_noindent("%s:", loop_label);
+
+	emit("mov vd%d vd%d", vregs_idx, i);
+	emit_store_var(n->for_iterator->lvar_valproppair, TYPE_INT);
+
+	emit_block(n->for_body, n->n_for_stmts);
+
+	emit("inc vd%d", i);
+	emit("cmp vd%d vd%d", i, end);
+	emit("jl %s", loop_label);
+	emit_noindent("%s:", end_label);
+}
+
+// the length is read once on entry, appending to the array inside the loop doesn't extend it, but
+// may move its elements, so the pointer is read again on every iteration
+static void emit_dynamic_for(Node *n)
+{
+	char *loop_label = makeLabel(1);
+	char *end_label = makeLabel(0);
+
+	int header;
+	if (n->for_enum->type == AST_IDENT) {
+		emit_array_base(n->for_enum->lvar_valproppair, vregs_idx);
+		header = vregs_idx++;
+	} else {
+		emit_expr(n->for_enum);
+		int ptr = vregs_idx-2;
+		int len = vregs_idx-1;
+		header = emit_dynamic_temp();
+		emit("mov [v%d] v%d", header, ptr);
+		emit("mov [v%d+8] v%d", header, len);
+	}
+
+	int idx = vregs_idx++;
+	int end = vregs_idx++;
+	int address = vregs_idx++;
+
+	emit_declaration(n->for_iterator);
+
+	emit("mov v%d [v%d+8]", end, header);
+	emit("cmp v%d 0", end);
+	emit("je %s", end_label);
+	emit("mov v%d 0", idx);
+	emit_noindent("%s:", loop_label);
+
+	emit("mov v%d [v%d]", address, header);
+	emit("mov vd%d [v%d+v%d*8]", vregs_idx, address, idx);
+	emit_store_var(n->for_iterator->lvar_valproppair, n->for_iterator->vtype);
+
+	emit_block(n->for_body, n->n_for_stmts);
+
+	emit("add v%d 1", idx);
+	emit("cmp v%d v%d", idx, end);
+	emit("jl %s", loop_label);
+	emit_noindent("%s:", end_label);
+}
+
+static void emit_for(Node *n)
+{
+#define for_enum (n->for_enum)
+#define for_it (n->for_iterator)
+
+	if (for_enum->type == AST_FUNCTION_CALL && find_intrinsic(for_enum) == INTRINSIC_RANGE) {
+		emit_range_for(n);
+		return;
+	} else if ((for_enum->type == AST_IDENT && is_dynamic(for_enum->lvar_valproppair)) || is_dynamic_call(for_enum)) {
+		emit_dynamic_for(n);
+		return;
+	}
+
+	int enum_off;
+	char *rodata = NULL;
+
+	int *sizes;
+
+	if (for_enum->type == AST_IDENT || for_enum->type == AST_STRING) {
+		if (for_enum->type == AST_IDENT) {
+			if (for_enum->lvar_valproppair->type != TYPE_STRING) {
+				enum_off = for_enum->lvar_valproppair->loff;
+				sizes = for_enum->lvar_valproppair->array_size;
+
+				goto cont_nostring;
+			}
+		}
+
+		char *loop_label = makeLabel(1);
+		char *end_label = makeLabel(0);
+		int acc = vregs_idx++;
+
+		emit_expr(for_enum);
+		int string = vregs_idx-2;
+		int len = vregs_idx-1;
+
+		emit_declaration(for_it);
+
+		emit("mov vd%d 0", acc);
+		emit("cmp v%d 0", len);
+		emit("je %s", end_label);
+		emit_noindent("%s:", loop_label);
+
+		if (for_it->vtype == TYPE_CHAR) {
+			emit("movzx vd%d byte [v%d+v%d]", vregs_idx, string, acc);
+			emit_store_var(for_it->lvar_valproppair, TYPE_INT);
+		} else {
+			// a one-character string pointing into the enumerated one, nothing is copied
+			emit("lea v%d [v%d+v%d]", vregs_idx++, string, acc);
+			emit("mov v%d 1", vregs_idx++);
+			emit_store_offset(for_it->lvar_valproppair->loff, for_it->vtype);
+		}
+
+		emit_block(n->for_body, n->n_for_stmts);
 
 		emit("inc vd%d", acc);
 		emit("cmp vd%d vd%d", acc, len);
 		emit("jl %s", loop_label);
+		emit_noindent("%s:", end_label);
 
 		return;
 	} else if (for_enum->type == AST_ARRAY) {
@@ -1843,12 +3472,23 @@ static void emit_for(Node *n)
 			acc *= sizes[i];
 		}
 
-		stack_offset += 8 * (acc+1);
+		// a constant literal is only read, so the loop walks it where it lies in .rodata
+		size_t member_sz = 0;
+		int iter = 0;
+		int **members = getArrayMembers(for_enum, &member_sz, acc, sizes[for_enum->array_dims-1], &iter, acc * 8);
+		if (member_sz == acc) {
+			rodata = emit_rodata_array(for_enum, members, member_sz);
+			enum_off = acc * 8;
+		}
 
-		enum_off = stack_offset;
+		if (!rodata) {
+			stack_offset += 8 * (acc+1);
 
-		size_t array_len = 0;
-		emit_offset_assign(for_enum->array_dims, sizes, &array_len, &for_enum->array_elems, stack_offset, for_enum);
+			enum_off = stack_offset;
+
+			size_t array_len = 0;
+			emit_offset_assign(for_enum->array_dims, sizes, &array_len, &for_enum->array_elems, stack_offset, for_enum);
+		}
 	} else if (for_enum->type == AST_FUNCTION_CALL) {
 		emit_func_call(for_enum);
 		stack_offset += 8;
@@ -1859,81 +3499,163 @@ static void emit_for(Node *n)
 cont_nostring:
 
 	char *loop_label = makeLabel(1);
-	int acc = vregs_idx++;
-	int len = vregs_idx++;
-	int idx = vregs_idx++;
 	int array_address = vregs_idx++;
+	int end_address = vregs_idx++;
 
 	emit_declaration(for_it);
 
-	emit("mov vd%d 0", acc);
-	emit("mov vd%d 0", idx);
-	emit("mov vd%d %d", len, sizes[0]);
-
-	if (for_enum->lvar_valproppair) {
-		if (for_enum->lvar_valproppair->is_array_reference) {
-			emit("mov v%d [rsp+%d]", array_address, enum_off);
-		} else {
-			emit("lea v%d [rsp+%d]", array_address, enum_off);
-		}
+	if (rodata) {
+		emit("lea v%d [%s+%d]", array_address, rodata, enum_off);
+	} else if (for_enum->lvar_valproppair) {
+		emit_array_base(for_enum->lvar_valproppair, array_address);
 	} else if (for_enum->type == AST_FUNCTION_CALL) {
 		emit("mov v%d [rsp+%d]", array_address, enum_off);
 	} else {
 		emit("lea v%d [rsp+%d]", array_address, enum_off);
 	}
 
-	emit_noindent("%s:", loop_label);
-
 	int sizeacc = 1;
 	for (int i = 0; i < for_it->v_array_dimensions; i++) {
 		sizeacc *= for_it->varray_size[i];
 	}
 
-	emit("lea vd%d [vd%d*8]", idx, acc);
-	emit("imul vd%d %d", idx, sizeacc);
+	// elements are laid out downwards, so the pointer walks the array in steps of -stride
+	int stride = 8 * sizeacc;
+	emit("lea v%d [v%d-%d]", end_address, array_address, sizes[0] * stride);
+
+	// a sum over the array is taken a vector at a time, the loop below only gets what's left over
+	Node *sum = vector_sum(n);
+	if (sum && sum->lvar_valproppair->type == TYPE_INT && sizes[0] >= VECTOR_LANES) {
+		emit_vector_sum(sum, array_address, sizes[0]);
+
+		if (sizes[0] % VECTOR_LANES == 0) {
+			// the iterator is left holding the last element
+			emit("mov vd%d [v%d+8]", vregs_idx, array_address);
+			emit_store_var(for_it->lvar_valproppair, for_it->vtype);
+			return;
+		}
+	}
+
+	emit_noindent("%s:", loop_label);
 
 	if (!for_it->v_array_dimensions) {
-		emit("sub v%d v%d", array_address, idx);
 		emit("mov vd%d [v%d]", vregs_idx, array_address);
-		emit("add v%d v%d", array_address, idx);
-		emit_store_offset(for_it->lvar_valproppair->loff, for_it->vtype);
+		emit_store_var(for_it->lvar_valproppair, for_it->vtype);
 	} else {
-		int it_sizes = 1;
-		for (int i = 0; i < for_it->v_array_dimensions; i++) {
-			it_sizes *= for_it->varray_size[i];
-		}
-
-		for (int i = 0; i < it_sizes; i++) {
-			emit("sub rsp v%d", idx);
-			emit("mov vd%d [rsp+%d]", vregs_idx, enum_off-(i*8));
-			emit("add rsp v%d", idx);
-			emit("mov qword [rsp+%d] vd%d", for_it->lvar_valproppair->loff-(i*8), vregs_idx);
+		for (int i = 0; i < sizeacc; i++) {
+			emit("mov vd%d [v%d-%d]", vregs_idx, array_address, i*8);
+			emit("mov [rsp+%d] vd%d", for_it->lvar_valproppair->loff-(i*8), vregs_idx);
 		}
 	}
 
 	emit_block(n->for_body, n->n_for_stmts);
 
-	emit("inc vd%d", acc);
-	emit("cmp vd%d vd%d", acc, len);
-	emit("jl %s", loop_label);
+	emit("sub v%d %d", array_address, stride);
+	emit("cmp v%d v%d", array_address, end_address);
+	emit("jne %s", loop_label);
 
 #undef for_enum
 #undef for_it
 }
 
+// 'return f(...)' can reuse the current frame if nothing passed to f points into it
+static int is_tail_call(Node *n)
+{
+	Node *call = n->retval;
+	if (call == NULL || call->type != AST_FUNCTION_CALL || call->global_function_idx < 0) {
+		return 0;
+	}
+
+	Node *caller = global_functions[current_func];
+	Node *callee = global_functions[call->global_function_idx];
+	if (caller->is_fn_entrypoint || callee->ret_array_dims || callee->n_params > N_ARG_REGS) {
+		return 0;
+	}
+
+	if (n->rettype != TYPE_INT && n->rettype != TYPE_BOOL) {
+		return 0;
+	}
+
+	for (int i = 0; i < callee->n_params; i++) {
+		int type = callee->fnparams[i]->lvar_valproppair->type;
+		if (type != TYPE_INT && type != TYPE_BOOL) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void emit_tail_call(Node *n)
+{
+	int idx = n->global_function_idx;
+	int words[n->n_args * 2];
+	int n_words = emit_call_args(n, words);
+
+	int arg_regs = 0;
+	for (int i = 0; i < n_words; i++) {
+		emit("mov %s v%d", Q_REGS[ARG_REGS[i]], words[i]);
+		arg_regs |= REG_BIT(ARG_REGS[i]);
+	}
+
+#define frame (frames[current_func])
+	if (idx == current_func) {
+		// self-recursion becomes a loop
+		emit("jmp tailrec_%d", current_func);
+		ins_array[ins_array_sz-1]->implicit_uses = arg_regs;
+		frame.tail_recursive = 1;
+		return;
+	}
+
+	// tear down the frame and let the callee return to our caller, the size is patched in later
+	emit("add rsp 0");
+	frame.tail_add_rsp = realloc(frame.tail_add_rsp, sizeof(MnemNode*) * (frame.n_tail_calls+1));
+	frame.tail_add_rsp[frame.n_tail_calls] = ins_array[ins_array_sz-1];
+
+	emit("pop rbp");
+	frame.tail_pop_rbp = realloc(frame.tail_pop_rbp, sizeof(MnemNode*) * (frame.n_tail_calls+1));
+	frame.tail_pop_rbp[frame.n_tail_calls++] = ins_array[ins_array_sz-1];
+
+	emit("jmp fn_%s", global_functions[idx]->flabel);
+	ins_array[ins_array_sz-1]->implicit_uses = arg_regs;
+	ins_array[ins_array_sz-1]->call_to = idx;
+#undef frame
+}
+
 static void emit_ret(Node *n)
 {
-	if (n->retval) {
+	if (is_tail_call(n)) {
+		emit_tail_call(n->retval);
+		return;
+	}
+
+	int dynamic = n->retval && n->retval->type == AST_IDENT && is_dynamic(n->retval->lvar_valproppair);
+	if (dynamic) {
+		// a local array is handed over as it is, a parameter's is copied so the caller doesn't share it
+		ValPropPair *pair = n->retval->lvar_valproppair;
+		int header;
+		if (pair->is_array_reference) {
+			header = emit_dynamic_temp();
+			emit_dynamic_append(header, n->retval);
+		} else {
+			emit_array_base(pair, vregs_idx);
+			header = vregs_idx++;
+		}
+		emit("mov rax [v%d]", header);
+		emit("mov rdx [v%d+8]", header);
+	} else if (n->retval) {
 		emit_expr(n->retval);
 
 		switch (n->rettype)
 		{
 			case TYPE_INT:
+			case TYPE_BOOL:
+			case TYPE_CHAR:
 				emit("mov rax v%d", vregs_idx++);
 				break;
 			case TYPE_STRING:
 				emit("mov rax v%d", vregs_idx-2);
-				emit("mov rbx [v%d]", vregs_idx-1);
+				emit("mov rdx v%d", vregs_idx-1);
 				break;
 			case TYPE_ARRAY:
 				emit("mov rax v%d", vregs_idx++);
@@ -1944,6 +3666,10 @@ static void emit_ret(Node *n)
 	}
 
 	emit("jmp ret_%d", current_func);
+	ins_array[ins_array_sz-1]->implicit_uses = REG_BIT(0);
+	if ((n->retval && n->rettype == TYPE_STRING) || dynamic) {
+		ins_array[ins_array_sz-1]->implicit_uses |= REG_BIT(3);
+	}
 }
 
 static void emit_expr(Node *expr)
@@ -1976,10 +3702,8 @@ static void emit_expr(Node *expr)
 			emit_if(expr);
 			break;
 		case AST_WHILE_STMT:
-			emit_while(expr);
-			break;
 		case AST_FOR_STMT:
-			emit_for(expr);
+			emit_loop(expr);
 			break;
 		case AST_FUNCTION_CALL:
 			emit_func_call(expr);
@@ -2048,6 +3772,36 @@ static int *liverange_union(int *live1, int *live2, size_t size1, size_t *size2)
 size_t live_range_sz;
 size_t used_vregs_n;
 
+static InterferenceNode *getInterferenceNode(InterferenceNode **g, int idx)
+{
+	if (!g[idx]) {
+		InterferenceNode *n = malloc(sizeof(InterferenceNode));
+		n->idx = idx;
+		n->neighbors = malloc(0);
+		n->neighbor_count = 0;
+		n->color = -1;
+		n->saturation = 0;
+		g[idx] = n;
+	}
+
+	return g[idx];
+}
+
+static void addInterference(InterferenceNode *a, InterferenceNode *b)
+{
+	for (int i = 0; i < a->neighbor_count; i++) {
+		if (a->neighbors[i] == b) {
+			return;
+		}
+	}
+
+	a->neighbors = realloc(a->neighbors, (a->neighbor_count+1) * sizeof(InterferenceNode*));
+	a->neighbors[a->neighbor_count++] = b;
+
+	b->neighbors = realloc(b->neighbors, (b->neighbor_count+1) * sizeof(InterferenceNode*));
+	b->neighbors[b->neighbor_count++] = a;
+}
+
 static InterferenceNode **lva()
 {
 	live_range_sz = ins_array_sz;
@@ -2058,20 +3812,20 @@ static InterferenceNode **lva()
 	int *used_vregs = calloc(vregs_count-MAX_REGISTER_COUNT, sizeof(int));
 	used_vregs_n = 0;
 
-	int **preserved_regs = calloc(global_function_count, sizeof(int *));
-	size_t *preserved_sz = calloc(global_function_count, sizeof(size_t));
-
-	int *syscall_list = NULL;
-	size_t syscall_list_sz = 0;
+	int *call_list = NULL;
+	size_t call_list_sz = 0;
 
 	int *prev_live_del;
 	size_t prev_live_del_sz = 0;
 
+	// registers read by the previous instruction stay live even if it also writes them
+	int *prev_live_use = NULL;
+	size_t prev_live_use_sz = 0;
+
 	MnemNode *n;
 
 	InterferenceNode **interference_graph = calloc(vregs_count, sizeof(InterferenceNode));
 
-	int current_func;
 	for (int p = 0; p < 2; p++) {
 		for (int i = live_range_sz-1; i >= 0; i--) {
 			int *live = NULL;
@@ -2085,7 +3839,7 @@ static InterferenceNode **lva()
 				if (n->type >= MOV && n->type <= LEA) {
 					if (n->right->type == VIRTUAL_REG || n->right->type == REAL_REG) {
 						live = addToLiveRange(n->right->idx, live, &live_sz);
-						if (!used_vregs[n->right->idx-MAX_REGISTER_COUNT] && n->right->type == VIRTUAL_REG) {
+						if (n->right->type == VIRTUAL_REG && !used_vregs[n->right->idx-MAX_REGISTER_COUNT]) {
 							used_vregs[n->right->idx - MAX_REGISTER_COUNT] = 1;
 							used_vregs_n++;
 						}
@@ -2109,9 +3863,15 @@ static InterferenceNode **lva()
 							live_del = addToLiveRange(n->left->idx, live_del, &live_del_sz);
 						}
 					} else if (n->left->type == BRACKET_EXPR) {
+						// registers in the address of a store are read, not written
+						int saved = live_sz;
 						for (int i = 0; i < n->left->n_vregs_used; i++) {
-							if (n->left->vregs_used[i]->first_def) {
-								live_del = addToLiveRange(n->left->vregs_used[i]->idx, live_del, &live_del_sz);
+							live = addToLiveRange(n->left->vregs_used[i]->idx, live, &live_sz);
+							if (saved != live_sz && !used_vregs[n->left->vregs_used[i]->idx-MAX_REGISTER_COUNT]
+							&& n->left->vregs_used[i]->type == VIRTUAL_REG) {
+
+								used_vregs[n->left->vregs_used[i]->idx - MAX_REGISTER_COUNT] = 1;
+								used_vregs_n++;
 							}
 						}
 					}
@@ -2119,7 +3879,7 @@ static InterferenceNode **lva()
 					if (n->type <= CMP) {	// is binary operation
 						if (n->right->type == VIRTUAL_REG || n->right->type == REAL_REG) {
 							live = addToLiveRange(n->right->idx, live, &live_sz);
-							if (!used_vregs[n->right->idx-MAX_REGISTER_COUNT] && n->right->type == VIRTUAL_REG) {
+							if (n->right->type == VIRTUAL_REG && !used_vregs[n->right->idx-MAX_REGISTER_COUNT]) {
 								used_vregs[n->right->idx-MAX_REGISTER_COUNT] = 1;
 								used_vregs_n++;
 							}
@@ -2138,7 +3898,7 @@ static InterferenceNode **lva()
 					}
 					if (n->left->type == VIRTUAL_REG || n->left->type == REAL_REG) {
 						live = addToLiveRange(n->left->idx, live, &live_sz);
-						if (!used_vregs[n->left->idx-MAX_REGISTER_COUNT] && n->left->type == VIRTUAL_REG) {
+						if (n->left->type == VIRTUAL_REG && !used_vregs[n->left->idx-MAX_REGISTER_COUNT]) {
 							used_vregs[n->left->idx-MAX_REGISTER_COUNT] = 1;
 							used_vregs_n++;
 						}
@@ -2161,26 +3921,34 @@ static InterferenceNode **lva()
 						live = addToLiveRange(3, live, &live_sz);
 					}
 					if (n->type == CALL) {
-						live_del = addToLiveRange(0, live_del, &live_del_sz);
+						call_list = realloc(call_list, sizeof(int) * (call_list_sz + 1));
+						call_list[call_list_sz++] = i;
 					}
 				} else if (n->type == SYSCALL) {
-					live = addToLiveRange(0, live, &live_sz); // rax
-					live = addToLiveRange(5, live, &live_sz); // rdi
-					live = addToLiveRange(4, live, &live_sz); // rsi
-					live = addToLiveRange(3, live, &live_sz); // rdx
-					live = addToLiveRange(8, live, &live_sz); // r10
-					live = addToLiveRange(6, live, &live_sz); // r8
-					live = addToLiveRange(7, live, &live_sz); // r9
-					live = addToLiveRange(2, live, &live_sz); // rcx
-					live = addToLiveRange(9, live, &live_sz); // r11
-
-					syscall_list = realloc(syscall_list, sizeof(int) * (syscall_list_sz + 1));
-					syscall_list[syscall_list_sz++] = i;
+					// reads rax and the argument registers, the kernel returns in rax and overwrites rcx and r11,
+					// see emit_syscall; whatever survives it stays clear of those
+					call_list = realloc(call_list, sizeof(int) * (call_list_sz + 1));
+					call_list[call_list_sz++] = i;
 				} else if (n->type == RET) {
 					live = addToLiveRange(0, live, &live_sz);
 				}
 
-				if (i == live_range_sz-1) {
+				for (int r = 0; r < MAX_REGISTER_COUNT; r++) {
+					if (n->implicit_uses & REG_BIT(r)) {
+						live = addToLiveRange(r, live, &live_sz);
+					}
+					if (n->implicit_defs & REG_BIT(r)) {
+						live_del = addToLiveRange(r, live_del, &live_del_sz);
+					}
+				}
+
+				int *uses = malloc(sizeof(int) * live_sz);
+				memcpy(uses, live, live_sz * sizeof(int));
+				size_t uses_sz = live_sz;
+
+				// nothing flows backwards out of a ret, a tail call or into the previous function
+				if (i == live_range_sz-1 || n->type == RET || (n->type == JMP && n->call_to >= 0)
+				|| ins_array[i+1]->is_function_label >= 0) {
 					live_range[i] = malloc(sizeof(int) * live_sz);
 					live_range[i] = memcpy(live_range[i], live, live_sz * sizeof(int));
 
@@ -2192,23 +3960,27 @@ static InterferenceNode **lva()
 
 					if (prev_live_del_sz) {
 						live_range[i] = liverange_subtract(live_range[i], prev_live_del, &live_sz, prev_live_del_sz);
-
-						live_sz_array[i] = live_sz;
-
-						free(prev_live_del);
-						prev_live_del_sz = 0;
-					} else {
-						live_sz_array[i] = live_sz;
+						live_range[i] = liverange_union(prev_live_use, live_range[i], prev_live_use_sz, &live_sz);
 					}
+					live_sz_array[i] = live_sz;
+				}
 
-					if (live_del_sz) {
-						prev_live_del = malloc(live_del_sz * sizeof(int));
-						memcpy(prev_live_del, live_del, live_del_sz * sizeof(int));
-						prev_live_del_sz = live_del_sz;
-					}
+				if (prev_live_del_sz) {
+					free(prev_live_del);
+					prev_live_del_sz = 0;
+				}
+
+				if (live_del_sz) {
+					prev_live_del = malloc(live_del_sz * sizeof(int));
+					memcpy(prev_live_del, live_del, live_del_sz * sizeof(int));
+					prev_live_del_sz = live_del_sz;
 				}
+
+				free(prev_live_use);
+				prev_live_use = uses;
+				prev_live_use_sz = uses_sz;
 			} else { 						// second pass
-				if (n->type >= JE && n->type <= GOTO) {		// control-flow change instruction
+				if (n->type >= JE && n->type <= GOTO && n->call_to < 0) {		// control-flow change instruction
 					char *label = n->left->mnem;
 					int *live_at_label = NULL;
 					size_t live_at_label_sz = 0;
@@ -2230,17 +4002,6 @@ static InterferenceNode **lva()
 							live_range[j] = liverange_union(live_at_label, live_range[j], live_at_label_sz, &live_sz_array[j]);
 						}
 					}
-				} else if (n->type == CALL) {			// inter-procedural preserving of registers
-					for (int l = 0; l < live_sz_array[i]; l++) {
-						if (live_range[i][l] >= MAX_REGISTER_COUNT) {
-							preserved_regs[n->call_to] = realloc(preserved_regs[n->call_to], sizeof(int) * (preserved_sz[n->call_to] + 1));
-							preserved_regs[n->call_to][preserved_sz[n->call_to]++] = live_range[i][l];
-							//preserved_regs[current_func] = realloc(preserved_regs[current_func], sizeof(int) * (preserved_sz[current_func] + 1));
-							//preserved_regs[current_func][preserved_sz[current_func]++] = live_range[i][l];
-						}
-					}
-				} else if (n->type == RET) {
-					current_func = n->ret_belongs_to;
 				}
 			}
 
@@ -2248,121 +4009,28 @@ static InterferenceNode **lva()
 		}
 	}
 
-#define func (global_functions[i])
-	for (int i = 0; i < global_function_count; i++) {
-		if (preserved_sz[i] > 0) {
-			ins_array = realloc(ins_array, (ins_array_sz + (2*preserved_sz[i])) * sizeof(MnemNode *));
-			live_range = realloc(live_range, (live_range_sz + (2*preserved_sz[i])) * sizeof(MnemNode *));
-			live_sz_array = realloc(live_sz_array, (live_range_sz + (2*preserved_sz[i])) * sizeof(MnemNode *));
-
-			// make space for inserting push instructions for saving regs at start of function body
-			memmove(&ins_array[func->start_body + preserved_sz[i]], &ins_array[func->start_body], sizeof(MnemNode *) * (ins_array_sz - func->start_body));
-			memmove(&live_range[func->start_body + preserved_sz[i]], &live_range[func->start_body], sizeof(MnemNode *) * (live_range_sz - func->start_body));
-			memmove(&live_sz_array[func->start_body + preserved_sz[i]], &live_sz_array[func->start_body], sizeof(MnemNode *) * (live_range_sz - func->start_body));
-			ins_array_sz += preserved_sz[i];
-			live_range_sz += preserved_sz[i];
-
-			func->end_body += preserved_sz[i];
-
-			// make space for inserting pop instructions for retrieving regs at end of function body
-			memmove(&ins_array[func->end_body + preserved_sz[i]], &ins_array[func->end_body], sizeof(MnemNode *) * (ins_array_sz - func->end_body));
-			memmove(&live_range[func->end_body + preserved_sz[i]], &live_range[func->end_body], sizeof(MnemNode *) * (live_range_sz - func->end_body));
-			memmove(&live_sz_array[func->end_body + preserved_sz[i]], &live_sz_array[func->end_body], sizeof(MnemNode *) * (live_range_sz - func->end_body));
-			ins_array_sz += preserved_sz[i];
-			live_range_sz += preserved_sz[i];
-
-			for (int j = 0; j < syscall_list_sz; j++) {
-				if (syscall_list[j] > func->end_body) {
-					syscall_list[j] += 2 * preserved_sz[i];
-				} else if (syscall_list[j] > func->start_body) {
-					syscall_list[j] += preserved_sz[i];
-				}
-			}
-
-			for (int j = i+1; j < global_function_count; j++) {
-				global_functions[j]->start_body += 2 * preserved_sz[i];
-				global_functions[j]->end_body += 2 * preserved_sz[i];
-			}
-
-			MnemNode *n;
-			for (int j = 0; j < preserved_sz[i]; j++) {
-				char *reg = malloc(10);
-				sprintf(reg, "v%d", preserved_regs[i][j]);
-
-				n = makeMnemNode("\tpush");
-				n->left = makeMnemNode(reg);
-
-				ins_array[func->start_body+j] = n;
-
-				n = makeMnemNode("\tpop");
-				n->left = makeMnemNode(reg);
-				ins_array[func->end_body + (-1 * (j - preserved_sz[i] + 1))] = n;
-
-				free(reg);
-			}
+	// values live across a call must not sit in registers the callee may clobber
+	int **call_clobbered = malloc(sizeof(int *) * call_list_sz);
+	size_t *call_clobbered_sz = calloc(call_list_sz, sizeof(size_t));
+	int *call_clobber_mask = malloc(sizeof(int) * call_list_sz);
+	for (int i = 0; i < call_list_sz; i++) {
+		int c = call_list[i];
+		call_clobbered[i] = NULL;
+		call_clobber_mask[i] = ins_array[c]->implicit_defs;
+		if (c+1 >= live_range_sz) {
+			continue;
 		}
-	}
-#undef func
-
-	for (int i = 0; i < syscall_list_sz; i++) {
-		int unused_arg_regs[9];
-		size_t unused_arg_regs_sz = 0;
-
-#define idx 		(syscall_list[i+1]+1) // last instruction before the next syscall
-#define is_sc_arg(x)	( (x==0) || (x==5) || (x==4) || (x==3) || (x==8) || (x==6) || (x==7) || (x==2) || (x==9) )
-		if (i == syscall_list_sz-1) {
-			for (int j = 0; j < live_sz_array[0]; j++) {
-				if (is_sc_arg(live_range[0][j])) {
-					unused_arg_regs[unused_arg_regs_sz++] = live_range[0][j];
-				}
+		for (int j = 0; j < live_sz_array[c]; j++) {
+			if (live_range[c][j] < MAX_REGISTER_COUNT) {
+				continue;
 			}
-		} else {
-			for (int j = 0; j < live_sz_array[idx]; j++) {
-				if (is_sc_arg(live_range[idx][j])) {
-					unused_arg_regs[unused_arg_regs_sz++] = live_range[idx][j];
+			for (int k = 0; k < live_sz_array[c+1]; k++) {
+				if (live_range[c+1][k] == live_range[c][j]) {
+					call_clobbered[i] = addToLiveRange(live_range[c][j], call_clobbered[i], &call_clobbered_sz[i]);
+					break;
 				}
 			}
 		}
-#undef is_sc_arg
-#undef idx
-
-		if (ins_array[syscall_list[i]]->in_loop) {
-			ins_array = realloc(ins_array, (ins_array_sz + 4) * sizeof(MnemNode *));
-
-			memmove(&ins_array[syscall_list[i] + 2], &ins_array[syscall_list[i]], sizeof(MnemNode *) * (ins_array_sz - syscall_list[i]));
-			ins_array_sz += 2;
-
-			MnemNode *rcx_push = makeMnemNode("\tpush");
-			rcx_push->left = makeMnemNode("rcx");
-			MnemNode *r11_push = makeMnemNode("\tpush");
-			r11_push->left = makeMnemNode("r11");
-
-			ins_array[syscall_list[i]] = rcx_push;
-			ins_array[syscall_list[i]+1] = r11_push;
-
-			for (int j = i; j < syscall_list_sz; j++) {
-				syscall_list[j] += 2;
-			}
-
-			memmove(&ins_array[syscall_list[i] + 3], &ins_array[syscall_list[i] + 1], sizeof(MnemNode *) * (ins_array_sz - (syscall_list[i]+1)));
-			ins_array_sz += 2;
-
-			MnemNode *rcx_pop = makeMnemNode("\tpop");
-			rcx_pop->left = makeMnemNode("rcx");
-			MnemNode *r11_pop = makeMnemNode("\tpop");
-			r11_pop->left = makeMnemNode("r11");
-
-
-			ins_array[syscall_list[i]+1] = r11_pop;
-			ins_array[syscall_list[i]+2] = rcx_pop;
-		}
-
-		for (int j = syscall_list[i]; j >= 0; j--) {
-			if (i != syscall_list_sz-1 && j == syscall_list[i+1])
-				break;
-
-			live_range[j] = liverange_subtract(live_range[j], &unused_arg_regs[0], &live_sz_array[j], unused_arg_regs_sz);
-		}
 	}
 
 	// create InterferenceNode for every live variable
@@ -2423,17 +4091,47 @@ static InterferenceNode **lva()
 		}
 	}
 
-	if (live_out) {
-		for (int i = 0; i < vregs_count; i++) {
-			if (i >= MAX_REGISTER_COUNT) {
-				printf("Neighbors of v%d:\n", i);
-			} else {
-				printf("Neighbors of %s:\n", Q_REGS[i]);
+	for (int i = 0; i < call_list_sz; i++) {
+		int clobbers = call_clobber_mask[i];
+		for (int j = 0; j < call_clobbered_sz[i]; j++) {
+			InterferenceNode *v = getInterferenceNode(interference_graph, call_clobbered[i][j]);
+			for (int r = 0; r < MAX_REGISTER_COUNT; r++) {
+				if (clobbers & REG_BIT(r)) {
+					addInterference(v, getInterferenceNode(interference_graph, r));
+				}
 			}
-			if (interference_graph[i]) {
-				for (int j = 0; j < interference_graph[i]->neighbor_count; j++) {
-					if (interference_graph[i]->neighbors[j]->idx >= MAX_REGISTER_COUNT) {
-						printf("\tv%d\n", interference_graph[i]->neighbors[j]->idx);
+		}
+	}
+
+	// a write clobbers whatever is live after it, even if the value itself is never read
+	for (int i = 0; i < live_range_sz-1; i++) {
+		n = ins_array[i];
+		if (n->type < MOV || n->type > LEA || n->left->type != VIRTUAL_REG) {
+			continue;
+		}
+		if (ins_array[i+1]->is_function_label >= 0) {
+			continue;
+		}
+
+		InterferenceNode *d = getInterferenceNode(interference_graph, n->left->idx);
+		for (int j = 0; j < live_sz_array[i+1]; j++) {
+			if (live_range[i+1][j] != d->idx) {
+				addInterference(d, getInterferenceNode(interference_graph, live_range[i+1][j]));
+			}
+		}
+	}
+
+	if (live_out) {
+		for (int i = 0; i < vregs_count; i++) {
+			if (i >= MAX_REGISTER_COUNT) {
+				printf("Neighbors of v%d:\n", i);
+			} else {
+				printf("Neighbors of %s:\n", Q_REGS[i]);
+			}
+			if (interference_graph[i]) {
+				for (int j = 0; j < interference_graph[i]->neighbor_count; j++) {
+					if (interference_graph[i]->neighbors[j]->idx >= MAX_REGISTER_COUNT) {
+						printf("\tv%d\n", interference_graph[i]->neighbors[j]->idx);
 					} else {
 						printf("\t%s\n", Q_REGS[interference_graph[i]->neighbors[j]->idx]);
 					}
@@ -2457,13 +4155,13 @@ static void color(InterferenceNode **g)
 		}
 	}
 
-	int colored_nodes = 0;
-	while (colored_nodes < used_vregs_n) {
+	for (;;) {
 		InterferenceNode *highest_sat = NULL;
 		// calculate saturation of each node
 		for (int i = MAX_REGISTER_COUNT; i < vregs_count; i++) {
 			if (g[i]) {
 				if (g[i]->color < 0) {
+					g[i]->saturation = 0;
 					for (int j = 0; j < g[i]->neighbor_count; j++) {
 						if (g[i]->neighbors[j]->color >= 0) {
 							g[i]->saturation++;
@@ -2496,18 +4194,26 @@ static void color(InterferenceNode **g)
 		
 		}
 
-		if (highest_sat->neighbor_count) {
-			sortByColor(highest_sat->neighbors, highest_sat->neighbor_count);
+		if (!highest_sat) {
+			break;
 		}
 
-		int lowest_color = -1;
+		int taken = 0;
 		for (int i = 0; i < highest_sat->neighbor_count; i++) {
-			if (highest_sat->neighbors[i]->color == lowest_color+1) {
-				lowest_color = highest_sat->neighbors[i]->color;
+			int c = highest_sat->neighbors[i]->color;
+			if (c >= 0 && c < MAX_REGISTER_COUNT) {
+				taken |= REG_BIT(c);
 			}
 		}
-		highest_sat->color = lowest_color+1;
-		colored_nodes++;
+
+		int c;
+		for (c = 0; c < MAX_REGISTER_COUNT; c++) {
+			if (!(taken & REG_BIT(COLOR_ORDER[c]))) {
+				break;
+			}
+		}
+		// running out of registers is reported when the color gets assigned
+		highest_sat->color = (c < MAX_REGISTER_COUNT) ? COLOR_ORDER[c] : MAX_REGISTER_COUNT;
 	}
 	if (live_out) {
 		for (int i = 0; i < vregs_count; i++) {
@@ -2616,9 +4322,9 @@ static char *substitute_vreg(char *str, char *reg)
 
 static void assign_registers(InterferenceNode **g)
 {
-	for (int i = 0; i < live_range_sz; i++) {
+	for (int i = 0; i < ins_array_sz; i++) {
 		MnemNode *n = ins_array[i];
-		if (MOV <= n->type && RET >= n->type) {
+		if (MOV <= n->type && RET >= n->type && n->left) {
 			if (n->left->type == VIRTUAL_REG) {
 				char *reg = assign_color(n->left->mnem, g);
 				if (reg) {
@@ -2656,58 +4362,1137 @@ static void assign_registers(InterferenceNode **g)
 }
 
 
-// Modified mergesort from https://github.com/geohot/mergesorts/blob/master/mergesort.c
-static void sortByColor(InterferenceNode **arr, size_t len)
+static int usedRegister(MnemNode *op, InterferenceNode **g)
 {
-	if (len == 1) { return; }
-	if (len == 2) {
-		if (arr[0]->color > arr[1]->color) {
-			InterferenceNode *t = arr[1];
-			arr[1] = arr[0];
-			arr[0] = t;
+	int mask = 0;
+	if (op == NULL) {
+		return 0;
+	}
+
+	if (op->type == REAL_REG) {
+		mask |= REG_BIT(op->idx);
+	} else if (op->type == VIRTUAL_REG) {
+		if (g[op->idx] && g[op->idx]->color >= 0 && g[op->idx]->color < MAX_REGISTER_COUNT) {
+			mask |= REG_BIT(g[op->idx]->color);
+		}
+	} else if (op->type == BRACKET_EXPR) {
+		for (int i = 0; i < op->n_vregs_used; i++) {
+			mask |= usedRegister(op->vregs_used[i], g);
 		}
 	}
 
-	size_t p = len/2;
-	InterferenceNode **arr1 = arr;
-	InterferenceNode **arr2 = arr+p;
+	return mask;
+}
 
-	sortByColor(arr1, p);
-	sortByColor(arr2, len-p);
+// collect the callee-saved registers every function touches after coloring
+static int *find_callee_saved(InterferenceNode **g)
+{
+	int *used = calloc(global_function_count, sizeof(int));
+	int func = -1;
 
-	InterferenceNode **t = malloc(sizeof(InterferenceNode *) * len);
-	InterferenceNode **rt = t;
-	while (1) {
-		if (arr1 < arr+p && arr2 < arr+len) {
-			if (arr1[0]->color <= arr2[0]->color) {
-				*t = *arr1;
-				arr1++;
-			} else {
-				*t = *arr2;
-				arr2++;
-			}
-		} else if(arr1 < arr+p) {
-			*t = *arr1;
-			arr1++;
-		} else if(arr2 < arr+len) {
-			*t = *arr2;
-			arr2++;
+	for (int i = 0; i < ins_array_sz; i++) {
+		MnemNode *n = ins_array[i];
+		if (n->is_function_label >= 0) {
+			func = n->is_function_label;
+		} else if (func >= 0 && n->type >= MOV && n->type <= POP) {
+			used[func] |= usedRegister(n->left, g);
+			if (n->type < INC) {
+				used[func] |= usedRegister(n->right, g);
+			}
+			used[func] &= CALLEE_SAVED_MASK;
+		}
+	}
+
+	return used;
+}
+
+static void insert_instruction(MnemNode *at, MnemNode *n, int after)
+{
+	int pos;
+	for (pos = 0; pos < ins_array_sz; pos++) {
+		if (ins_array[pos] == at) {
+			break;
+		}
+	}
+	pos += after;
+
+	ins_array = realloc(ins_array, sizeof(MnemNode *) * (ins_array_sz+1));
+	memmove(&ins_array[pos+1], &ins_array[pos], sizeof(MnemNode *) * (ins_array_sz-pos));
+	ins_array[pos] = n;
+	ins_array_sz++;
+}
+
+static void insert_callee_saves(int *used)
+{
+	for (int f = 0; f < global_function_count; f++) {
+		if (!frames[f].save_after || !used[f]) {
+			continue;
+		}
+
+		for (int r = MAX_REGISTER_COUNT-1; r >= 0; r--) {
+			if (used[f] & REG_BIT(r)) {
+				MnemNode *n = makeMnemNode("\tpush");
+				n->left = makeMnemNode(Q_REGS[r]);
+				insert_instruction(frames[f].save_after, n, 1);
+
+				n = makeMnemNode("\tpop");
+				n->left = makeMnemNode(Q_REGS[r]);
+				insert_instruction(frames[f].restore_before, n, 0);
+
+				for (int t = 0; t < frames[f].n_tail_calls; t++) {
+					n = makeMnemNode("\tpop");
+					n->left = makeMnemNode(Q_REGS[r]);
+					insert_instruction(frames[f].tail_pop_rbp[t], n, 0);
+				}
+			}
+		}
+	}
+}
+
+static int find_instruction(MnemNode *n)
+{
+	for (int i = 0; i < ins_array_sz; i++) {
+		if (ins_array[i] == n) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static void remove_instruction(MnemNode *n)
+{
+	int pos = find_instruction(n);
+	if (pos < 0) {
+		return;
+	}
+
+	memmove(&ins_array[pos], &ins_array[pos+1], sizeof(MnemNode *) * (ins_array_sz - (pos+1)));
+	ins_array_sz--;
+}
+
+// turn [rsp+K] and [rsp+K+index] into an address relative to the caller's rsp, i.e. into the red zone
+static void rebase_stack_operand(MnemNode *op, int size)
+{
+	int off, len;
+	if (op == NULL || op->type != BRACKET_EXPR) {
+		return;
+	}
+
+	if (sscanf(op->mnem, "[rsp+%d%n", &off, &len) == 1 && (op->mnem[len] == ']' || op->mnem[len] == '+')) {
+		char *mnem = malloc(strlen(op->mnem) + 20);
+		sprintf(mnem, "[rsp-%d%s", size - off, &op->mnem[len]);
+		free(op->mnem);
+		op->mnem = mnem;
+	}
+}
+
+// drop the frame pointer and stack adjustment where the function body allows it
+static void finalize_frames()
+{
+	for (int f = 0; f < global_function_count; f++) {
+		Frame *fr = &frames[f];
+		if (!fr->label) {
+			continue;
+		}
+
+		int start = find_instruction(fr->label);
+		int end;
+		for (end = start+1; end < ins_array_sz; end++) {
+			if (ins_array[end]->is_function_label >= 0) {
+				break;
+			}
+		}
+
+		int leaf = 1;
+		int dynamic_rsp = 0;
+		int stack_refs = 0;
+		for (int i = start; i < end; i++) {
+			MnemNode *n = ins_array[i];
+			if (n->type == CALL || n->type == SYSCALL) {
+				leaf = 0;
+			} else if ((n->type == ADD || n->type == SUB) && !strcmp(n->left->mnem, "rsp") && n->right->type != LITERAL) {
+				dynamic_rsp = 1;
+			}
+			if (n->type >= MOV && n->type <= POP) {
+				if (n->left->type == BRACKET_EXPR && strstr(n->left->mnem, "rsp")) {
+					stack_refs = 1;
+				} else if (n->type < INC && n->right->type == BRACKET_EXPR && strstr(n->right->mnem, "rsp")) {
+					stack_refs = 1;
+				}
+			}
+		}
+
+		if ((leaf || omit_frame_pointer) && !fr->stack_params) {
+			remove_instruction(fr->push_rbp);
+			remove_instruction(fr->set_rbp);
+			remove_instruction(fr->pop_rbp);
+			end -= 3;
+			for (int t = 0; t < fr->n_tail_calls; t++) {
+				remove_instruction(fr->tail_pop_rbp[t]);
+				end--;
+			}
+		}
+
+		// small leaf frames live below rsp, so rsp never has to move
+		if (leaf && !dynamic_rsp && fr->size - 8 <= RED_ZONE_SIZE) {
+			for (int i = start; i < end; i++) {
+				MnemNode *n = ins_array[i];
+				if (n->type >= MOV && n->type <= POP) {
+					rebase_stack_operand(n->left, fr->size);
+					if (n->type < INC) {
+						rebase_stack_operand(n->right, fr->size);
+					}
+				}
+			}
+
+			remove_instruction(fr->sub_rsp);
+			remove_instruction(fr->add_rsp);
+			for (int t = 0; t < fr->n_tail_calls; t++) {
+				remove_instruction(fr->tail_add_rsp[t]);
+			}
+		} else if (!stack_refs && !dynamic_rsp) {
+			// every local ended up in a register
+			remove_instruction(fr->sub_rsp);
+			remove_instruction(fr->add_rsp);
+			for (int t = 0; t < fr->n_tail_calls; t++) {
+				remove_instruction(fr->tail_add_rsp[t]);
+			}
+		}
+	}
+}
+
+// instructions that write their left operand
+static int is_def(MnemNode *n)
+{
+	return (n->type >= MOV && n->type <= SHL) || (n->type >= INC && n->type <= NOT && n->type != DIV) || n->type == POP;
+}
+
+static int is_jump(MnemNode *n)
+{
+	return n->type >= JE && n->type <= GOTO;
+}
+
+static size_t collect_vregs(MnemNode *op, int *vregs, size_t n)
+{
+	if (op == NULL) {
+		return n;
+	}
+
+	if (op->type == VIRTUAL_REG) {
+		vregs[n++] = op->idx;
+	} else if (op->type == BRACKET_EXPR) {
+		for (int i = 0; i < op->n_vregs_used && n < 16; i++) {
+			vregs[n++] = op->vregs_used[i]->idx;
+		}
+	}
+
+	return n;
+}
+
+// every virtual register read or written by n, at most 16
+static size_t instruction_vregs(MnemNode *n, int *vregs)
+{
+	size_t sz = 0;
+	if (n->type < MOV || n->type > POP) {
+		return 0;
+	}
+
+	sz = collect_vregs(n->left, vregs, sz);
+	if (n->type < INC && sz < 16) {
+		sz = collect_vregs(n->right, vregs, sz);
+	}
+
+	return sz;
+}
+
+static int occurs_in(MnemNode *n, int v)
+{
+	int vregs[16];
+	size_t sz = instruction_vregs(n, vregs);
+	for (int i = 0; i < sz; i++) {
+		if (vregs[i] == v) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// a mov/lea writing the whole of a virtual register without reading it
+static int is_fresh_def(MnemNode *n)
+{
+	if ((n->type != MOV && n->type != LEA) || n->left->type != VIRTUAL_REG || n->left->idx < MAX_REGISTER_COUNT) {
+		return 0;
+	}
+	if (n->left->mode != 'q' && n->left->mode != 'd') {
+		return 0;
+	}
+
+	int vregs[16];
+	size_t sz = collect_vregs(n->right, vregs, 0);
+	for (int i = 0; i < sz; i++) {
+		if (vregs[i] == n->left->idx) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static MnemNode *rename_vreg(MnemNode *op, int from, int to)
+{
+	char buf[64];
+	if (op == NULL) {
+		return NULL;
+	}
+
+	if (op->type == VIRTUAL_REG && op->idx == from) {
+		if (op->mode == 'q') {
+			sprintf(buf, "v%d", to);
 		} else {
+			sprintf(buf, "v%c%d", op->mode, to);
+		}
+		return makeMnemNode(buf);
+	} else if (op->type == BRACKET_EXPR && strlen(op->mnem) < 32) {
+		size_t len = 0;
+		for (char *c = op->mnem; *c; ) {
+			if (*c == 'v') {
+				char *t = c+1;
+				if (*t == 'd' || *t == 'w' || *t == 'b') {
+					t++;
+				}
+				char *digits = t;
+				while (isdigit(*t)) {
+					t++;
+				}
+				if (t > digits && atoi(digits) == from) {
+					memcpy(&buf[len], c, digits-c);
+					len += digits-c;
+					len += sprintf(&buf[len], "%d", to);
+					c = t;
+					continue;
+				}
+			}
+			buf[len++] = *c++;
+		}
+		buf[len] = '\0';
+		return makeMnemNode(buf);
+	}
+
+	return op;
+}
+
+static void note_hoisted(int f, MnemNode *n, MnemNode *anchor, int added)
+{
+	hoisted = realloc(hoisted, sizeof(Hoisted) * (hoisted_sz+1));
+	hoisted[hoisted_sz].ins = n;
+	hoisted[hoisted_sz].anchor = anchor;
+	hoisted[hoisted_sz].left = n->left;
+	hoisted[hoisted_sz].right = n->right;
+	hoisted[hoisted_sz].added = added;
+	hoisted[hoisted_sz].group = hoist_groups;
+	hoisted[hoisted_sz++].func = f;
+}
+
+static BasicBlock *build_blocks(int start, int end, int *block_of, int *n_blocks)
+{
+	BasicBlock *blocks = NULL;
+	int nb = 0;
+
+	for (int i = start; i < end; i++) {
+		MnemNode *n = ins_array[i];
+		int leader = (i == start || n->type == LABEL);
+		if (!leader) {
+			leader = is_jump(ins_array[i-1]) || ins_array[i-1]->type == RET;
+		}
+
+		if (leader) {
+			blocks = realloc(blocks, sizeof(BasicBlock) * (nb+1));
+			blocks[nb].start = i;
+			blocks[nb].n_succ = 0;
+			blocks[nb].reachable = 0;
+			blocks[nb].dom = NULL;
+			blocks[nb].in_loop = 0;
+			nb++;
+		}
+		blocks[nb-1].end = i+1;
+		block_of[i-start] = nb-1;
+	}
+
+	for (int b = 0; b < nb; b++) {
+		MnemNode *last = ins_array[blocks[b].end-1];
+		if (last->type == RET || (last->type == JMP && last->call_to >= 0)) {
+			continue;
+		}
+
+		if (is_jump(last)) {
+			for (int i = start; i < end; i++) {
+				if (ins_array[i]->type == LABEL && !strcmp(ins_array[i]->mnem, last->left->mnem)) {
+					blocks[b].succ[blocks[b].n_succ++] = block_of[i-start];
+					break;
+				}
+			}
+			if (last->type == JMP || last->type == GOTO) {
+				continue;
+			}
+		}
+
+		if (b+1 < nb) {
+			blocks[b].succ[blocks[b].n_succ++] = b+1;
+		}
+	}
+
+	*n_blocks = nb;
+	return blocks;
+}
+
+static void mark_reachable(BasicBlock *blocks, int b)
+{
+	if (blocks[b].reachable) {
+		return;
+	}
+
+	blocks[b].reachable = 1;
+	for (int i = 0; i < blocks[b].n_succ; i++) {
+		mark_reachable(blocks, blocks[b].succ[i]);
+	}
+}
+
+static void find_dominators(BasicBlock *blocks, int nb)
+{
+	mark_reachable(blocks, 0);
+
+	for (int b = 0; b < nb; b++) {
+		blocks[b].dom = malloc(nb);
+		memset(blocks[b].dom, b != 0, nb);
+		blocks[b].dom[b] = 1;
+	}
+
+	char *meet = malloc(nb);
+	int changed = 1;
+	while (changed) {
+		changed = 0;
+		for (int b = 1; b < nb; b++) {
+			if (!blocks[b].reachable) {
+				continue;
+			}
+
+			memset(meet, 1, nb);
+			for (int p = 0; p < nb; p++) {
+				if (!blocks[p].reachable) {
+					continue;
+				}
+				for (int i = 0; i < blocks[p].n_succ; i++) {
+					if (blocks[p].succ[i] == b) {
+						for (int d = 0; d < nb; d++) {
+							meet[d] &= blocks[p].dom[d];
+						}
+					}
+				}
+			}
+			meet[b] = 1;
+
+			if (memcmp(meet, blocks[b].dom, nb)) {
+				memcpy(blocks[b].dom, meet, nb);
+				changed = 1;
+			}
+		}
+	}
+
+	free(meet);
+}
+
+// blocks of the natural loop of the back edge tail -> header
+static void add_natural_loop(BasicBlock *blocks, int nb, char *loop, int header, int tail)
+{
+	int stack[nb];
+	int sp = 0;
+
+	loop[header] = 1;
+	if (!loop[tail]) {
+		loop[tail] = 1;
+		stack[sp++] = tail;
+	}
+
+	while (sp) {
+		int b = stack[--sp];
+		for (int p = 0; p < nb; p++) {
+			if (!blocks[p].reachable || loop[p]) {
+				continue;
+			}
+			for (int i = 0; i < blocks[p].n_succ; i++) {
+				if (blocks[p].succ[i] == b) {
+					loop[p] = 1;
+					stack[sp++] = p;
+					break;
+				}
+			}
+		}
+	}
+}
+
+// v keeps its value throughout the loop or is a cheap copy made earlier in the same block as at
+static int invariant_vreg(int v, int at, LoopEffects *fx)
+{
+	if (!fx->defs[v]) {
+		return 1;
+	}
+
+	return fx->remat[v] >= 0 && fx->remat[v] < at && fx->block_of[fx->remat[v]-fx->start] == fx->block_of[at-fx->start];
+}
+
+// rsp, rbp, numbers and symbols don't change inside a loop unless the loop moves rsp
+static int invariant_address(MnemNode *op, int at, LoopEffects *fx)
+{
+	for (int i = 0; i < op->n_vregs_used; i++) {
+		if (!invariant_vreg(op->vregs_used[i]->idx, at, fx)) {
+			return 0;
+		}
+	}
+
+	char tok[32];
+	size_t tok_sz = 0;
+	for (char *c = op->mnem; ; c++) {
+		if (isalnum(*c) && tok_sz < sizeof(tok)-1) {
+			tok[tok_sz++] = *c;
+			continue;
+		}
+
+		if (tok_sz) {
+			tok[tok_sz] = '\0';
+			char mode;
+			if (!strcmp(tok, "rsp") || !strcmp(tok, "rbp")) {
+				if (fx->rsp_changes) {
+					return 0;
+				}
+			} else if (realRegToIdx(tok, &mode) >= 0) {
+				return 0;
+			}
+			tok_sz = 0;
+		}
+
+		if (*c == '\0') {
 			break;
 		}
-		t++;
 	}
 
-	memcpy(arr, rt, sizeof(InterferenceNode *) * len);
-	free(rt);
+	return 1;
+}
+
+static int invariant_operand(MnemNode *op, int self, int at, int is_lea, LoopEffects *fx)
+{
+	if (op == NULL) {
+		return 1;
+	}
+
+	switch (op->type)
+	{
+		case LITERAL:
+			return 1;
+		case VIRTUAL_REG:
+			return op->idx == self || invariant_vreg(op->idx, at, fx);
+		case BRACKET_EXPR:
+			if (is_lea) {
+				return invariant_address(op, at, fx);
+			}
+			// only loads from the frame, those can't fault when done once too often
+			if (fx->mem_writes || op->n_vregs_used || (strncmp(op->mnem, "[rsp", 4) && strncmp(op->mnem, "[rbp", 4))) {
+				return 0;
+			}
+			return invariant_address(op, at, fx);
+		case REAL_REG:
+			return 0;
+		default:
+			// symbols, plus rsp and rbp which aren't tracked as registers
+			if (!strcmp(op->mnem, "rsp") || !strcmp(op->mnem, "rbp")) {
+				return !fx->rsp_changes;
+			}
+			return op->type == 0;
+	}
+}
+
+static void insert_at(int pos, MnemNode *n)
+{
+	ins_array = realloc(ins_array, sizeof(MnemNode*) * (ins_array_sz+1));
+	memmove(&ins_array[pos+1], &ins_array[pos], sizeof(MnemNode*) * (ins_array_sz-pos));
+	ins_array[pos] = n;
+	ins_array_sz++;
+}
+
+static MnemNode *make_copy(int to, char mode, MnemNode *from)
+{
+	char reg[16];
+	sprintf(reg, mode == 'd' ? "vd%d" : "v%d", to);
+
+	MnemNode *copy = makeMnemNode("\tmov");
+	copy->left = makeMnemNode(reg);
+	copy->left->first_def = 1;
+
+	char *src = malloc(strlen(from->mnem) + 1);
+	strcpy(src, from->mnem);
+	copy->right = makeMnemNode(src);
+
+	return copy;
+}
+
+static void rename_in(int f, MnemNode *n, int from, int to)
+{
+	note_hoisted(f, n, NULL, 0);
+	n->left = rename_vreg(n->left, from, to);
+	if (n->type < INC) {
+		n->right = rename_vreg(n->right, from, to);
+	}
+}
+
+// moves the instructions computing one loop-invariant value in front of the loop, returns 1 if it did
+static int hoist_loop(int f, int start, int end, BasicBlock *blocks, int nb, int *block_of, int header)
+{
+	int pre = -1;
+	int n_outside = 0;
+	for (int b = 0; b < nb; b++) {
+		if (!blocks[b].reachable || blocks[b].in_loop) {
+			continue;
+		}
+		for (int i = 0; i < blocks[b].n_succ; i++) {
+			if (blocks[b].succ[i] == header) {
+				pre = b;
+				n_outside++;
+			}
+		}
+	}
+	if (n_outside != 1) {
+		return 0;
+	}
+
+	// the end of the only block entering the loop serves as preheader
+	int pos;
+	MnemNode *last = ins_array[blocks[pre].end-1];
+	MnemNode *header_label = ins_array[blocks[header].start];
+	int jumps_to_header = is_jump(last) && header_label->type == LABEL && !strcmp(last->left->mnem, header_label->mnem);
+	if (last->type == JMP && jumps_to_header) {
+		pos = blocks[pre].end-1;
+	} else if (blocks[pre].end == blocks[header].start && !jumps_to_header) {
+		pos = blocks[header].start;
+	} else {
+		return 0;
+	}
+
+	LoopEffects fx;
+	fx.defs = calloc(vregs_count, sizeof(int));
+	fx.remat = malloc(sizeof(int) * vregs_count);
+	fx.rsp_changes = 0;
+	fx.mem_writes = 0;
+	fx.block_of = block_of;
+	fx.start = start;
+	fx.n_vregs = vregs_count;
+
+	for (int i = start; i < end; i++) {
+		MnemNode *n = ins_array[i];
+		if (!blocks[block_of[i-start]].in_loop) {
+			continue;
+		}
+
+		if (n->type == PUSH || n->type == POP) {
+			fx.rsp_changes = 1;
+			fx.mem_writes = 1;
+		} else if (n->type == CALL || n->type == SYSCALL) {
+			fx.mem_writes = 1;
+		} else if (n->type == 0 || n->type == VEC) {
+			// anything that isn't understood may write memory, and so do vector stores
+			fx.mem_writes = 1;
+		}
+
+		if (is_def(n)) {
+			if (n->left->type == VIRTUAL_REG) {
+				fx.defs[n->left->idx]++;
+			} else if (n->left->type == BRACKET_EXPR) {
+				fx.mem_writes = 1;
+			} else if (!strcmp(n->left->mnem, "rsp")) {
+				fx.rsp_changes = 1;
+			}
+		}
+	}
+
+	// registers only written by copying an invariant can have the copy repeated in front of the loop
+	for (int v = 0; v < vregs_count; v++) {
+		fx.remat[v] = -1;
+	}
+	for (int i = start; i < end; i++) {
+		MnemNode *n = ins_array[i];
+		if (!blocks[block_of[i-start]].in_loop || !is_fresh_def(n) || fx.defs[n->left->idx] != 1 || n->type != MOV) {
+			continue;
+		}
+		if (n->right->type == LITERAL || (n->right->type == VIRTUAL_REG && !fx.defs[n->right->idx])) {
+			fx.remat[n->left->idx] = i;
+		}
+	}
+
+	// values that stay within one block may be used there before and after the hoisted one
+	int *first = malloc(sizeof(int) * vregs_count);
+	int *single_block = malloc(sizeof(int) * vregs_count);
+	for (int v = 0; v < vregs_count; v++) {
+		first[v] = -1;
+		single_block[v] = 1;
+	}
+	for (int i = start; i < end; i++) {
+		int vregs[16];
+		size_t sz = instruction_vregs(ins_array[i], vregs);
+		for (int j = 0; j < sz; j++) {
+			int v = vregs[j];
+			if (first[v] < 0) {
+				first[v] = i;
+			} else if (block_of[first[v]-start] != block_of[i-start]) {
+				single_block[v] = 0;
+			}
+		}
+	}
+
+	int hoisted_any = 0;
+	for (int i = start; i < end && !hoisted_any; i++) {
+		MnemNode *d = ins_array[i];
+		int b = block_of[i-start];
+		if (!blocks[b].in_loop || !is_fresh_def(d) || pos > blocks[b].start) {
+			continue;
+		}
+
+		// the value lives from d up to the next fresh definition of v, the invariant instructions
+		// computing it have to come before all of its uses
+		int v = d->left->idx;
+		int chain[blocks[b].end - i];
+		size_t chain_sz = 0;
+		int seg_end = blocks[b].end;
+		int stop = -1;
+		int used = 0;
+		int ok = 1;
+		for (int k = i; k < blocks[b].end && ok; k++) {
+			MnemNode *n = ins_array[k];
+			if (k > i && is_fresh_def(n) && n->left->idx == v) {
+				seg_end = k;
+				break;
+			}
+			if (!occurs_in(n, v)) {
+				continue;
+			}
+
+			if (is_def(n) && n->left->type == VIRTUAL_REG && n->left->idx == v && n->type != POP) {
+				if (used || n->implicit_uses || n->implicit_defs) {
+					ok = 0;
+				} else if (n->type < INC && !invariant_operand(n->right, v, k, n->type == LEA, &fx)) {
+					// the invariant part is hoisted and copied back in here
+					stop = k;
+					break;
+				} else if (n->type != MOV && n->type != LEA && n->type != NOT) {
+					// the flags it sets must not be read
+					int next = k+1;
+					while (next < blocks[b].end && ins_array[next]->type == NEWLINE) {
+						next++;
+					}
+					if (next < blocks[b].end && is_jump(ins_array[next]) && ins_array[next]->type < JMP) {
+						ok = 0;
+					}
+				}
+
+				chain[chain_sz++] = k;
+			} else {
+				used = 1;
+			}
+		}
+
+		// immediates, symbol addresses and copies are as cheap to redo as to keep in a register
+		int cheap = chain_sz == 1 && d->type == MOV && (d->right->type == LITERAL || d->right->type == VIRTUAL_REG || d->right->type == 0);
+
+		// a value reaching the end of the block may be read elsewhere
+		if (!ok || !chain_sz || cheap || (stop < 0 && seg_end == blocks[b].end && !single_block[v])) {
+			continue;
+		}
+
+		// copies the chain reads from are repeated in front of it
+		int remat[chain_sz * 16];
+		size_t remat_sz = 0;
+		for (int k = 0; k < chain_sz; k++) {
+			int vregs[16];
+			size_t sz = instruction_vregs(ins_array[chain[k]], vregs);
+			for (int j = 0; j < sz; j++) {
+				int w = vregs[j];
+				int l;
+				for (l = 0; l < remat_sz && remat[l] != w; l++);
+				if (w != v && fx.defs[w] && l == remat_sz) {
+					remat[remat_sz++] = w;
+				}
+			}
+		}
+		MnemNode *remat_def[remat_sz];
+		for (int l = 0; l < remat_sz; l++) {
+			remat_def[l] = ins_array[fx.remat[remat[l]]];
+		}
+
+		// values that share their register with others get a register of their own
+		if (stop >= 0 || first[v] < i || seg_end < blocks[b].end) {
+			int nv = vregs_count++;
+			int first_def = d->left->first_def;
+			for (int k = i; k < (stop >= 0 ? stop : seg_end); k++) {
+				if (occurs_in(ins_array[k], v)) {
+					rename_in(f, ins_array[k], v, nv);
+				}
+			}
+			d->left->first_def = 1;
+
+			if (stop >= 0) {
+				MnemNode *copy = make_copy(v, d->left->mode, d->left);
+				copy->right = rename_vreg(copy->right, v, nv);
+				copy->left->first_def = first_def;
+				insert_at(stop, copy);
+				note_hoisted(f, copy, NULL, 1);
+			}
+		}
+
+		MnemNode *nodes[chain_sz];
+		for (int k = 0; k < chain_sz; k++) {
+			int at = chain[k];
+			nodes[k] = ins_array[at];
+
+			// the closest instruction in front of it that stays in place
+			int anchor = at-1;
+			for (int j = k-1; j >= 0 && chain[j] == anchor; j--) {
+				anchor--;
+			}
+
+			note_hoisted(f, nodes[k], ins_array[anchor], 0);
+		}
+
+		for (int k = chain_sz-1; k >= 0; k--) {
+			memmove(&ins_array[chain[k]], &ins_array[chain[k]+1], sizeof(MnemNode*) * (ins_array_sz - (chain[k]+1)));
+			ins_array_sz--;
+		}
+
+		for (int k = chain_sz-1; k >= 0; k--) {
+			insert_at(pos, nodes[k]);
+		}
+
+		for (int l = 0; l < remat_sz; l++) {
+			int nw = vregs_count++;
+			MnemNode *copy = make_copy(nw, remat_def[l]->left->mode, remat_def[l]->right);
+			insert_at(pos, copy);
+			note_hoisted(f, copy, NULL, 1);
+
+			for (int k = 0; k < chain_sz; k++) {
+				if (occurs_in(nodes[k], remat[l])) {
+					rename_in(f, nodes[k], remat[l], nw);
+				}
+			}
+
+			// the copy left in the loop may have been read by the chain only
+			int at = find_instruction(remat_def[l]);
+			int k;
+			for (k = start; k < end; k++) {
+				if (k != at && occurs_in(ins_array[k], remat[l])) {
+					break;
+				}
+			}
+			if (k == end) {
+				note_hoisted(f, remat_def[l], ins_array[at-1], 0);
+				remove_instruction(remat_def[l]);
+			}
+		}
+
+		hoist_groups++;
+		hoisted_any = 1;
+	}
+
+	free(fx.defs);
+	free(fx.remat);
+	free(first);
+	free(single_block);
+
+	return hoisted_any;
+}
+
+// loop-invariant code motion over the natural loops of every function
+static void hoist_invariants()
+{
+	for (int start = 0; start < ins_array_sz; start++) {
+		if (ins_array[start]->is_function_label < 0) {
+			continue;
+		}
+
+		int f = ins_array[start]->is_function_label;
+		int again = 1;
+		while (again) {
+			again = 0;
+
+			int end;
+			for (end = start+1; end < ins_array_sz; end++) {
+				if (ins_array[end]->is_function_label >= 0) {
+					break;
+				}
+			}
+
+			int *block_of = malloc(sizeof(int) * (end-start));
+			int nb;
+			BasicBlock *blocks = build_blocks(start, end, block_of, &nb);
+			find_dominators(blocks, nb);
+
+			// an edge to a dominator closes a loop, loops sharing a header are merged
+			char **loops = calloc(nb, sizeof(char *));
+			int *loop_sz = calloc(nb, sizeof(int));
+			for (int b = 0; b < nb; b++) {
+				if (!blocks[b].reachable) {
+					continue;
+				}
+				for (int i = 0; i < blocks[b].n_succ; i++) {
+					int h = blocks[b].succ[i];
+					if (blocks[b].dom[h]) {
+						if (!loops[h]) {
+							loops[h] = calloc(nb, 1);
+						}
+						add_natural_loop(blocks, nb, loops[h], h, b);
+					}
+				}
+			}
+
+			for (int h = 0; h < nb; h++) {
+				if (!loops[h]) {
+					continue;
+				}
+				for (int b = 0; b < nb; b++) {
+					if (!loops[h][b]) {
+						continue;
+					}
+					loop_sz[h] += blocks[b].end - blocks[b].start;
+				}
+			}
+
+			// inner loops first, so that their invariants can move further out afterwards
+			for (;;) {
+				int h = -1;
+				for (int l = 0; l < nb; l++) {
+					if (loops[l] && (h < 0 || loop_sz[l] < loop_sz[h])) {
+						h = l;
+					}
+				}
+				if (h < 0) {
+					break;
+				}
+
+				for (int b = 0; b < nb; b++) {
+					blocks[b].in_loop = loops[h][b];
+				}
+				free(loops[h]);
+				loops[h] = NULL;
+
+				if (hoist_loop(f, start, end, blocks, nb, block_of, h)) {
+					again = 1;
+					break;
+				}
+			}
+
+			for (int b = 0; b < nb; b++) {
+				free(loops[b]);
+				free(blocks[b].dom);
+			}
+			free(loops);
+			free(loop_sz);
+			free(blocks);
+			free(block_of);
+		}
+	}
+}
+
+// undoes the last value hoisted out of a loop of function f
+static int unhoist(int f)
+{
+	int group = -1;
+	for (int i = 0; i < hoisted_sz; i++) {
+		if (hoisted[i].func == f && hoisted[i].ins) {
+			group = hoisted[i].group;
+		}
+	}
+
+	int moved = 0;
+	for (int i = hoisted_sz-1; i >= 0; i--) {
+		Hoisted *h = &hoisted[i];
+		if (h->func != f || !h->ins || h->group != group) {
+			continue;
+		}
+
+		if (h->added) {
+			remove_instruction(h->ins);
+		} else if (h->anchor) {
+			remove_instruction(h->ins);
+			insert_instruction(h->anchor, h->ins, 1);
+		}
+		h->ins->left = h->left;
+		h->ins->right = h->right;
+		h->ins = NULL;
+		moved = 1;
+	}
+
+	return moved;
+}
+
+static int isSpilled(MnemNode *op, InterferenceNode **g)
+{
+	if (op == NULL) {
+		return 0;
+	}
+
+	if (op->type == VIRTUAL_REG) {
+		return g[op->idx] && g[op->idx]->color >= MAX_REGISTER_COUNT;
+	} else if (op->type == BRACKET_EXPR) {
+		for (int i = 0; i < op->n_vregs_used; i++) {
+			if (isSpilled(op->vregs_used[i], g)) {
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int names_vreg(MnemNode *op, int v)
+{
+	return op && op->type == VIRTUAL_REG && op->idx == v;
+}
+
+// replaces every mention of the variable's register by its stack slot, movs between a register and the slot
+// take it directly, everything else goes through a fresh register loaded before and stored after the instruction
+static void demote(ValPropPair *victim)
+{
+	int home = victim->home;
+	char mode = victim->type == TYPE_ARRAY ? 'q' : 'd';
+	char slot[32];
+	sprintf(slot, "[rsp+%d]", victim->loff);
+
+	for (int i = 0; i < ins_array_sz; i++) {
+		MnemNode *n = ins_array[i];
+		if (!occurs_in(n, home)) {
+			continue;
+		}
+
+		if (n->type == MOV && names_vreg(n->left, home) && n->right->type != BRACKET_EXPR && !names_vreg(n->right, home)) {
+			n->left = makeMnemNode(slot);
+			if (n->right->type == LITERAL) {
+				n->left_spec = makeMnemNode(mode == 'q' ? "qword" : "dword");
+			}
+			continue;
+		} else if (n->type == MOV && names_vreg(n->right, home) && n->left->type != BRACKET_EXPR && !names_vreg(n->left, home)) {
+			n->right = makeMnemNode(slot);
+			continue;
+		}
+
+		int t = vregs_count++;
+		int reads = !is_fresh_def(n) || !names_vreg(n->left, home);
+		int writes = is_def(n) && names_vreg(n->left, home);
+
+		n->left = rename_vreg(n->left, home, t);
+		if (n->type < INC) {
+			n->right = rename_vreg(n->right, home, t);
+		}
+
+		if (reads) {
+			insert_at(i++, make_copy(t, mode, makeMnemNode(slot)));
+		} else {
+			n->left->first_def = 1;
+		}
+		if (writes) {
+			char reg[16];
+			sprintf(reg, mode == 'd' ? "vd%d" : "v%d", t);
+			MnemNode *store = makeMnemNode("\tmov");
+			store->left = makeMnemNode(slot);
+			store->right = makeMnemNode(reg);
+			insert_at(++i, store);
+		}
+	}
+}
+
+// put one promoted variable of every function that ran out of registers back into its stack slot,
+// functions with hoisted loop invariants first get those moved back into their loops one by one
+static int demote_spilled(InterferenceNode **g)
+{
+	int *spilled = calloc(global_function_count, sizeof(int));
+	int func = -1;
+
+	for (int i = 0; i < ins_array_sz; i++) {
+		MnemNode *n = ins_array[i];
+		if (n->is_function_label >= 0) {
+			func = n->is_function_label;
+		} else if (func >= 0 && n->type >= MOV && n->type <= POP) {
+			if (isSpilled(n->left, g) || (n->type < INC && isSpilled(n->right, g))) {
+				spilled[func] = 1;
+			}
+		}
+	}
+
+	int demoted = 0;
+	for (int f = 0; f < global_function_count; f++) {
+		if (!spilled[f]) {
+			continue;
+		}
+
+		if (unhoist(f)) {
+			demoted = 1;
+			continue;
+		}
+
+		ValPropPair *victim = NULL;
+		size_t victim_degree = 0;
+		for (int i = 0; i < promoted_sz; i++) {
+			if (promoted_func[i] != f || !promoted[i]->home || !g[promoted[i]->home]) {
+				continue;
+			}
+			if (!victim || g[promoted[i]->home]->neighbor_count > victim_degree) {
+				victim = promoted[i];
+				victim_degree = g[victim->home]->neighbor_count;
+			}
+		}
+		if (!victim) {
+			continue;
+		}
+
+		demote(victim);
+
+		victim->home = 0;
+		demoted = 1;
+	}
+
+	free(spilled);
+	return demoted;
 }
 
 static void gen_nasm()
 {
+	// some emitters name the next register without claiming it
 	vregs_count = vregs_idx;
+	for (int i = 0; i < ins_array_sz; i++) {
+		int vregs[16];
+		size_t sz = instruction_vregs(ins_array[i], vregs);
+		for (int j = 0; j < sz; j++) {
+			if (vregs[j] >= vregs_count) {
+				vregs_count = vregs[j]+1;
+			}
+		}
+	}
+
+	begin_phase("hoist_invariants");
+	hoist_invariants();
+	end_phase();
+
+	InterferenceNode **graph;
+	do {
+		begin_phase("lva");
+		graph = lva();
+		end_phase();
 
-	InterferenceNode **graph = lva();
-	color(graph);
+		begin_phase("color");
+		color(graph);
+		end_phase();
+	} while (demote_spilled(graph));
 
+	int *callee_saved = find_callee_saved(graph);
+	begin_phase("assign_registers");
 	assign_registers(graph);
+	end_phase();
+	insert_callee_saves(callee_saved);
+	finalize_frames();
 }
@@ -1,44 +1,5 @@
 void gen();
 
-enum MnemType {
-	MOV = 1,
-	LEA,
-	ADD,
-	SUB,
-	IMUL,
-	AND,
-	OR,
-	SHR,
-	SHL,
-	CMP,
-	INC,
-	DEC,
-	DIV,
-	NEG,
-	NOT,
-	JE,
-	JNE,
-	JL,
-	JLE,
-	JG,
-	JGE,
-	JMP,
-	GOTO,
-	CALL,
-	PUSH,
-	POP,
-	RET,
-	BRACKET_EXPR,
-	BRACKET_ADD,
-	VIRTUAL_REG,
-	REAL_REG,
-	LABEL,
-	LITERAL,
-	SPECIFIER,
-	SYSCALL,
-	NEWLINE,
-};
-
 typedef struct MnemNode {
 	int type;
 	char *mnem;
@@ -55,9 +16,11 @@ typedef struct MnemNode {
 	// only for virtual registers
 	int first_def;
 	int ret_belongs_to;
-	int call_to;
+	int call_to;	// callee of a CALL or of a jmp ending in a tail call, -1 otherwise
 	int is_function_label;
-	int in_loop;
+	// bitmasks of real registers read/written without appearing as operands
+	int implicit_uses;
+	int implicit_defs;
 	int idx;
 	char mode;
 } MnemNode;
@@ -70,3 +33,81 @@ typedef struct InterferenceNode {
 	int color;
 	int saturation;
 } InterferenceNode;
+
+typedef struct BasicBlock {
+	// instructions [start, end) of ins_array
+	int start;
+	int end;
+	int succ[2];
+	int n_succ;
+	int reachable;
+	// dom[b] is set if block b dominates this one
+	char *dom;
+	// set for the blocks of the loop currently being looked at
+	int in_loop;
+} BasicBlock;
+
+// undo information for an instruction moved or renamed by loop-invariant code motion
+typedef struct Hoisted {
+	MnemNode *ins;
+	MnemNode *anchor;	// instruction it followed before it was moved, NULL if it stayed
+	MnemNode *left;
+	MnemNode *right;
+	int added;	// copies of hoisted values are inserted by the pass itself
+	int group;	// everything done to hoist one value
+	int func;
+} Hoisted;
+
+// what a loop changes, used to decide which of its instructions are invariant
+typedef struct LoopEffects {
+	int *defs;	// number of definitions of each virtual register inside the loop
+	int *remat;	// the only definition if it copies an invariant, -1 otherwise
+	int n_vregs;
+	int rsp_changes;
+	int mem_writes;
+	int *block_of;
+	int start;
+} LoopEffects;
+
+typedef struct Frame {
+	// nodes making up the prologue/epilogue, patched once the body is known
+	MnemNode *label;
+	MnemNode *push_rbp;
+	MnemNode *set_rbp;
+	MnemNode *pop_rbp;
+	MnemNode *sub_rsp;
+	MnemNode *add_rsp;
+	// where callee-saved registers get pushed/popped once coloring is known
+	MnemNode *save_after;
+	MnemNode *restore_before;
+	// epilogues emitted in front of sibling tail calls
+	MnemNode **tail_add_rsp;
+	MnemNode **tail_pop_rbp;
+	int n_tail_calls;
+	// set when a self-recursive tail call was turned into a jump back to the body
+	int tail_recursive;
+	int size;
+	int stack_params;
+} Frame;
+
+// string local a loop only ever extends, kept in a growable buffer until the loop is left
+typedef struct Builder {
+	char *name;
+	int state;	// frame offset of the buffer's base, capacity, start and end
+	int loff;
+} Builder;
+
+// string locals extended inside a loop, and how often they're mentioned there
+typedef struct Extensions {
+	char **names;
+	int *expected;	// mentions made by the extensions themselves
+	int *mentions;
+	int *loff;
+	size_t n;
+} Extensions;
+
+// an array parameter and whether the function it belongs to may store into it
+typedef struct ParamWrites {
+	char *name;
+	int written;
+} ParamWrites;
@@ -0,0 +1,446 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "parse.h"
+#include "error.h"
+#include "ast.h"
+#include "inline.h"
+
+#define INLINE_THRESHOLD	40	// AST nodes a callee may have to be inlined at every call site
+#define SINGLE_CALL_THRESHOLD	400	// same for callees with exactly one call site
+
+enum {
+	INLINE_UNVISITED,
+	INLINE_IN_PROGRESS,
+	INLINE_DONE,
+};
+
+typedef struct {
+	Node **stmts;
+	size_t size;
+} Hoist;
+
+static Node **inline_block();
+static void inline_expr();
+static int should_inline();
+
+static int *state;
+static int *inlinable;
+static int *body_size;
+static int *call_sites;
+static int inline_count;
+
+// call graph of the program as written
+static int **callees;
+static int *n_callees;
+static int current;
+
+static void count_call(Node *n, void *data)
+{
+	int caller = *(int *) data;
+	if (n->type == AST_FUNCTION_CALL) {
+		int idx = find_function(n->call_label);
+		if (idx >= 0) {
+			call_sites[idx]++;
+			callees[caller] = realloc(callees[caller], sizeof(int) * (n_callees[caller]+1));
+			callees[caller][n_callees[caller]++] = idx;
+		}
+	}
+}
+
+static void find_return(Node *n, void *data)
+{
+	if (n->type == AST_RETURN_STMT) {
+		*(int *) data = 1;
+	}
+}
+
+static void find_call(Node *n, void *data)
+{
+	if (n->type == AST_FUNCTION_CALL) {
+		*(int *) data = 1;
+	}
+}
+
+// records and arrays are bound by reference, which a local copy can't express
+static void find_unsupported(Node *n, void *data)
+{
+	if (n->type == AST_FIELD_ACCESS || (n->type == AST_DECLARATION && n->vtype == TYPE_RECORD)) {
+		*(int *) data = 1;
+	}
+}
+
+static int block_contains(Node **block, size_t sz, void (*fn)(Node *, void *))
+{
+	int found = 0;
+	visit_block(block, sz, fn, &found);
+	return found;
+}
+
+static int contains(Node *n, void (*fn)(Node *, void *))
+{
+	return block_contains(&n, 1, fn);
+}
+
+// Return lowering
+
+// Rewrites early returns into if/else chains that fall through to the end of the body, with the
+// returned value assigned to 'result'. Fails if a return sits anywhere an if/else can't reach,
+// e.g. inside a loop.
+static Node **lower_returns(Node **block, size_t n, size_t *out_sz, char *result, int *ok)
+{
+	Node **out = NULL;
+	*out_sz = 0;
+
+	for (int i = 0; i < n; i++) {
+		Node *s = block[i];
+		if (s->type == AST_RETURN_STMT) {
+			if (result && s->retval) {
+				append(&out, out_sz, assignment(ident(result), s->retval));
+			}
+			return out;
+		} else if (s->type == AST_IF_STMT && contains(s, find_return)) {
+			if (!s->n_if_stmts || s->if_body[s->n_if_stmts-1]->type != AST_RETURN_STMT) {
+				*ok = 0;
+				return out;
+			}
+
+			Node **rest = NULL;
+			size_t rest_sz = 0;
+			for (int j = 0; j < s->n_else_stmts; j++) {
+				append(&rest, &rest_sz, s->else_body[j]);
+			}
+			for (int j = i+1; j < n; j++) {
+				append(&rest, &rest_sz, block[j]);
+			}
+
+			s->if_body = lower_returns(s->if_body, s->n_if_stmts, &s->n_if_stmts, result, ok);
+			s->else_body = lower_returns(rest, rest_sz, &s->n_else_stmts, result, ok);
+
+			append(&out, out_sz, s);
+			return out;
+		} else if (contains(s, find_return)) {
+			*ok = 0;
+			return out;
+		}
+
+		append(&out, out_sz, s);
+	}
+
+	return out;
+}
+
+// returns only appear as the very last statement of the body
+static int is_straight_line(Node *fn)
+{
+	if (fn->n_stmts == 0) {
+		return 1;
+	}
+
+	Node *last = fn->fnbody[fn->n_stmts-1];
+	if (last->type != AST_RETURN_STMT && contains(last, find_return)) {
+		return 0;
+	}
+
+	return !block_contains(fn->fnbody, fn->n_stmts-1, find_return);
+}
+
+static int can_inline(Node *fn)
+{
+	if (fn->is_fn_entrypoint || fn->ret_array_dims) {
+		return 0;
+	}
+
+	switch (fn->return_type)
+	{
+		case TYPE_INT:
+		case TYPE_BOOL:
+		case TYPE_STRING:
+		case TYPE_VOID:
+			break;
+		default:
+			return 0;
+	}
+
+	for (int i = 0; i < fn->n_params; i++) {
+		Node *p = fn->fnparams[i];
+		if (p->v_array_dimensions || (p->vtype != TYPE_INT && p->vtype != TYPE_BOOL && p->vtype != TYPE_STRING)) {
+			return 0;
+		}
+	}
+
+	if (block_contains(fn->fnbody, fn->n_stmts, find_unsupported)) {
+		return 0;
+	}
+
+	if (is_straight_line(fn)) {
+		return 1;
+	}
+
+	// an early-returned string would have to be copied into a buffer of unknown size
+	if (fn->return_type == TYPE_STRING) {
+		return 0;
+	}
+
+	RenameMap map = {NULL, NULL, NULL, 0};
+	Node **body = clone_block(fn->fnbody, fn->n_stmts, &map);
+	size_t sz;
+	int ok = 1;
+	lower_returns(body, fn->n_stmts, &sz, fn->return_type == TYPE_VOID ? NULL : "", &ok);
+
+	return ok;
+}
+
+// Expansion
+
+// replaces the call with the callee's body, hoisted in front of the current statement
+static void expand(Node *call, int idx, Hoist *h)
+{
+	Node *fn = global_functions[idx];
+	int k = inline_count++;
+
+	RenameMap map = {NULL, NULL, NULL, 0};
+	for (int i = 0; i < fn->n_params; i++) {
+		collect_locals(fn->fnparams[i], &map);
+	}
+	visit_block(fn->fnbody, fn->n_stmts, collect_locals, &map);
+
+	for (int i = 0; i < fn->n_params; i++) {
+		Node *p = fn->fnparams[i];
+		Node *arg = call->callargs[i];
+
+		char *name = p->vlabel;
+		visit_block(fn->fnbody, fn->n_stmts, find_assigned, &name);
+
+		// read-only scalar parameters take the argument directly
+		if (name && p->vtype != TYPE_STRING && (arg->type == AST_IDENT || arg->type == AST_INT || arg->type == AST_BOOL)) {
+			map.subst[i] = arg;
+		} else {
+			map.to[i] = unique_name(fn->flabel, k, p->vlabel);
+			append(&h->stmts, &h->size, assignment(declaration(map.to[i], p->vtype), arg));
+		}
+	}
+	for (int i = fn->n_params; i < map.size; i++) {
+		map.to[i] = unique_name(fn->flabel, k, map.from[i]);
+	}
+
+	Node **body = clone_block(fn->fnbody, fn->n_stmts, &map);
+	size_t n = fn->n_stmts;
+
+	char *result = NULL;
+	if (fn->return_type != TYPE_VOID) {
+		result = unique_name(fn->flabel, k, "");	// no local has an empty name
+	}
+
+	if (is_straight_line(fn)) {
+		Node *ret = NULL;
+		if (n && body[n-1]->type == AST_RETURN_STMT) {
+			ret = body[--n];
+		}
+		for (int i = 0; i < n; i++) {
+			append(&h->stmts, &h->size, body[i]);
+		}
+		if (result) {
+			Node *value = (ret && ret->retval) ? ret->retval : zero_value(fn->return_type);
+			append(&h->stmts, &h->size, assignment(declaration(result, fn->return_type), value));
+		}
+	} else {
+		if (result) {
+			append(&h->stmts, &h->size, assignment(declaration(result, fn->return_type), zero_value(fn->return_type)));
+		}
+
+		int ok = 1;
+		body = lower_returns(body, n, &n, result, &ok);
+		for (int i = 0; i < n; i++) {
+			append(&h->stmts, &h->size, body[i]);
+		}
+	}
+
+	// whatever used the call's value now reads the result variable
+	call->type = AST_IDENT;
+	call->name = result;
+}
+
+static void inline_expr(Node *e, Hoist *h, int *blocked)
+{
+	if (e->type >= AST_ADD && e->type <= AST_LE) {
+		inline_expr(e->left, h, blocked);
+		inline_expr(e->right, h, blocked);
+		return;
+	}
+
+	switch (e->type)
+	{
+		case AST_FUNCTION_CALL:
+		{
+			int saved = *blocked;
+			for (int i = 0; i < e->n_args; i++) {
+				inline_expr(e->callargs[i], h, blocked);
+			}
+
+			// a call can't move in front of another call that stays in place
+			int idx = find_function(e->call_label);
+			if (find_intrinsic(e)) {
+				break;
+			} else if (!saved && idx >= 0 && should_inline(idx)) {
+				expand(e, idx, h);
+			} else {
+				*blocked = 1;
+			}
+			break;
+		}
+		case AST_ARRAY:
+		case AST_IDX_ARRAY:
+			if (contains(e, find_call)) {
+				*blocked = 1;
+			}
+			break;
+	}
+}
+
+static Node **inline_block(Node **block, size_t *n)
+{
+	Node **out = NULL;
+	size_t out_sz = 0;
+
+	for (int i = 0; i < *n; i++) {
+		Node *s = block[i];
+		Hoist h = {NULL, 0};
+		int blocked = 0;
+		int drop = 0;
+
+		switch (s->type)
+		{
+			case AST_IF_STMT:
+				inline_expr(s->if_cond, &h, &blocked);
+				s->if_body = inline_block(s->if_body, &s->n_if_stmts);
+				if (s->n_else_stmts) {
+					s->else_body = inline_block(s->else_body, &s->n_else_stmts);
+				}
+				break;
+			case AST_WHILE_STMT:
+				// the condition is evaluated on every iteration, so nothing can be hoisted out of it
+				s->while_body = inline_block(s->while_body, &s->n_while_stmts);
+				break;
+			case AST_FOR_STMT:
+				s->for_body = inline_block(s->for_body, &s->n_for_stmts);
+				break;
+			case AST_RETURN_STMT:
+				if (s->retval) {
+					inline_expr(s->retval, &h, &blocked);
+				}
+				break;
+			case AST_FUNCTION_CALL:
+				inline_expr(s, &h, &blocked);
+				// the call's value, if any, isn't used
+				drop = (s->type != AST_FUNCTION_CALL);
+				break;
+			default:
+				if (s->type >= AST_ASSIGN && s->type <= AST_MOD_ASSIGN) {
+					inline_expr(s->right, &h, &blocked);
+				}
+				break;
+		}
+
+		for (int j = 0; j < h.size; j++) {
+			append(&out, &out_sz, h.stmts[j]);
+		}
+		if (!drop) {
+			append(&out, &out_sz, s);
+		}
+	}
+
+	*n = out_sz;
+	return out;
+}
+
+static int reaches(int from, int to, char *seen)
+{
+	if (from == to) {
+		return 1;
+	}
+
+	seen[from] = 1;
+	for (int i = 0; i < n_callees[from]; i++) {
+		if (!seen[callees[from][i]] && reaches(callees[from][i], to, seen)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// the callee calls back into the caller, directly or through other functions
+static int same_cycle(int callee, int caller)
+{
+	char *seen = calloc(global_function_count, 1);
+	int found = reaches(callee, caller, seen);
+	free(seen);
+	return found;
+}
+
+static void process_function(int idx)
+{
+	Node *fn = global_functions[idx];
+	int caller = current;
+
+	current = idx;
+	state[idx] = INLINE_IN_PROGRESS;
+
+	fn->fnbody = inline_block(fn->fnbody, &fn->n_stmts);
+
+	body_size[idx] = 0;
+	visit_block(fn->fnbody, fn->n_stmts, count_node, &body_size[idx]);
+	inlinable[idx] = can_inline(fn);
+
+	if (fn->inline_hint > 0 && !inlinable[idx]) {
+		char msg[128];
+		sprintf(msg, "Function %s can't be inlined.", fn->flabel);
+		c_warning(msg, -1);
+	}
+
+	state[idx] = INLINE_DONE;
+	current = caller;
+}
+
+static int should_inline(int idx)
+{
+	Node *fn = global_functions[idx];
+
+	if (state[idx] == INLINE_IN_PROGRESS) {	// recursion
+		return 0;
+	} else if (state[idx] == INLINE_UNVISITED) {
+		process_function(idx);
+	}
+
+	// inlining one function of a mutual recursion into another turns their tail calls into plain ones
+	if (!inlinable[idx] || fn->inline_hint < 0 || same_cycle(idx, current)) {
+		return 0;
+	} else if (fn->inline_hint > 0) {
+		return 1;
+	}
+
+	return body_size[idx] <= INLINE_THRESHOLD || (call_sites[idx] == 1 && body_size[idx] <= SINGLE_CALL_THRESHOLD);
+}
+
+// Inlines calls bottom-up, so callees already contain their own inlined calls when they get copied.
+void inline_functions()
+{
+	state = calloc(global_function_count, sizeof(int));
+	inlinable = calloc(global_function_count, sizeof(int));
+	body_size = calloc(global_function_count, sizeof(int));
+	call_sites = calloc(global_function_count, sizeof(int));
+	callees = calloc(global_function_count, sizeof(int *));
+	n_callees = calloc(global_function_count, sizeof(int));
+	inline_count = 0;
+
+	for (int i = 0; i < global_function_count; i++) {
+		visit_block(global_functions[i]->fnbody, global_functions[i]->n_stmts, count_call, &i);
+	}
+
+	for (int i = 0; i < global_function_count; i++) {
+		if (state[i] == INLINE_UNVISITED) {
+			process_function(i);
+		}
+	}
+}
@@ -0,0 +1 @@
+void inline_functions();
@@ -82,6 +82,8 @@ static int is_type_specifier(char *str)
 		return 1;
 	} else if (!strcmp(str, "bool")) {
 		return 1;
+	} else if (!strcmp(str, "char")) {
+		return 1;
 	} else {
 		return 0;
 	}
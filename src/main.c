@@ -6,6 +6,7 @@
 #include "lex.h"
 #include "parse.h"
 #include "error.h"
+#include "report.h"
 
 static void printHelp()
 {
@@ -22,6 +23,14 @@ static void printHelp()
 	"-dlive		Print lva and graph-colorer output\n"
 	"-dps		Print pseudo-assembly output(collides with above option)\n"
 	"-D		Show all debug output (except -dps)\n"
+	"-fomit-frame-pointer	Don't set up rbp in functions that don't need it\n"
+	"-fno-inline	Don't inline any function calls\n"
+	"-fno-unroll	Don't unroll any loops\n"
+	"-fno-ctfe	Don't evaluate any function calls at compile time\n"
+	"-fno-buffered-output	Write everything printed right away\n"
+	"-ftime-report	Print time, heap growth and memory used by each compiler phase\n"
+	"-ftime-report=json	Same as above, as JSON\n"
+	"-mavx2		Use 256-bit AVX2 instead of SSE2 in vectorized loops\n"
 	"-h		Print this help page\n"
 	);
 }
@@ -31,6 +40,13 @@ int cfg_out = 0;
 int sym_out = 0;
 int live_out = 0;
 int ps_out = 0;
+int omit_frame_pointer = 0;
+int no_inline = 0;
+int no_unroll = 0;
+int no_ctfe = 0;
+int avx2 = 0;
+int no_buffered_output = 0;
+int time_report = 0;
 
 int main(int argc, char **argv)
 {
@@ -91,6 +107,34 @@ int main(int argc, char **argv)
 					cfg_out = 1;
 					sym_out = 1;
 					live_out = 1;
+					break;
+				case 'f':
+					if (!strcmp(&option[2], "omit-frame-pointer")) {
+						omit_frame_pointer = 1;
+					} else if (!strcmp(&option[2], "no-inline")) {
+						no_inline = 1;
+					} else if (!strcmp(&option[2], "no-unroll")) {
+						no_unroll = 1;
+					} else if (!strcmp(&option[2], "no-ctfe")) {
+						no_ctfe = 1;
+					} else if (!strcmp(&option[2], "no-buffered-output")) {
+						no_buffered_output = 1;
+					} else if (!strcmp(&option[2], "time-report")) {
+						time_report = TIME_REPORT_TEXT;
+					} else if (!strcmp(&option[2], "time-report=json")) {
+						time_report = TIME_REPORT_JSON;
+					} else {
+						printf("Unknown option: %s.\n", &option[1]);
+					}
+
+					break;
+				case 'm':
+					if (!strcmp(&option[2], "avx2")) {
+						avx2 = 1;
+					} else {
+						printf("Unknown option: %s.\n", &option[1]);
+					}
+
 					break;
 				case 'h':
 					printHelp();
@@ -103,6 +147,8 @@ int main(int argc, char **argv)
 			}
 		}
 
+		begin_phase("lex");
+
 		char *input = readFile(filename);
 
 		if (input) {
@@ -117,6 +163,8 @@ int main(int argc, char **argv)
 				free(Token.repr);
 		} while (Token.class != EoF);
 
+		end_phase();
+
 		if (lex_out) {
 			for (int i = 0; i < Token_stream_size; i++) {
 				printf("%s\n", Token_stream[i].repr);
@@ -128,18 +176,24 @@ int main(int argc, char **argv)
 		if (!assembly_out && !ps_out) {
 			char *cmd = malloc(128);
 			sprintf(cmd, "nasm -felf64 %s.s", output_file);
+			begin_phase("nasm");
 			system(cmd);
+			end_phase();
 
 			sprintf(cmd, "rm %s.s", output_file);
 			system(cmd);
 
 			sprintf(cmd, "ld -o %s %s.o", output_file, output_file);
+			begin_phase("ld");
 			system(cmd);
+			end_phase();
 
 			sprintf(cmd, "rm %s.o", output_file);
 			system(cmd);
 		}
 
+		print_time_report();
+
 		return 0;
 	}
 
@@ -9,8 +9,10 @@
 #include "error.h"
 
 #include "gen.h"
-
-#define DYNAMIC_ARRAYS_ENABLED 0
+#include "inline.h"
+#include "unroll.h"
+#include "ctfe.h"
+#include "report.h"
 
 static int pos;
 
@@ -34,6 +36,7 @@ static Node *read_stmt();
 static Node *read_if_stmt();
 static Node *read_while_stmt();
 static Node *read_for_stmt();
+static Node *read_unroll_hint();
 static Node *read_return_stmt();
 
 static Node *read_assignment_expr();
@@ -55,6 +58,7 @@ static Node *read_fn_def();
 static Node *read_fn_call();
 static Node **read_fn_parameters();
 static Node **read_fn_body();
+static int lookup_intrinsic();
 
 // AST traversal
 static void traverse();
@@ -86,6 +90,7 @@ static void interpret_func_call();
 static void interpret_binary_expr();
 static void interpret_binary_int_expr();
 static void interpret_binary_string_expr();
+static void interpret_binary_char_expr();
 static void interpret_binary_array_expr();
 static void interpret_binary_ident_expr();
 static void interpret_binary_idx_expr();
@@ -101,6 +106,8 @@ void parser_init(char *outputfile_name)
 {
 	pos = 0;
 
+	begin_phase("parse");
+
 	Node **node_array = malloc(0);
 	size_t array_len = 0;
 
@@ -123,6 +130,11 @@ void parser_init(char *outputfile_name)
 
 	for (int i = 0; i < array_len; i++) {
 		if (node_array[i]->type == AST_FUNCTION_DEF) {
+			if (find_function(node_array[i]->flabel) >= 0) {
+				char msg[128];
+				snprintf(msg, sizeof(msg), "Function %s is defined more than once.", node_array[i]->flabel);
+				c_error(msg, -1);
+			}
 			global_functions = realloc(global_functions, (global_function_count+1) * sizeof(Node*));
 			node_array[i]->global_idx = global_function_count;
 			global_functions[global_function_count] = node_array[i];
@@ -134,7 +146,36 @@ void parser_init(char *outputfile_name)
 		}
 	}
 
+	end_phase();
+
+	if (!no_ctfe) {
+		begin_phase("ctfe");
+		evaluate_calls();
+		end_phase();
+	}
+
+	if (!no_inline) {
+		begin_phase("inline");
+		inline_functions();
+		end_phase();
+	}
+
+	if (!no_unroll) {
+		begin_phase("unroll");
+		unroll_loops();
+		end_phase();
+
+		// unrolled loops leave their iterators constant
+		if (!no_ctfe) {
+			begin_phase("ctfe");
+			evaluate_calls();
+			end_phase();
+		}
+	}
+
+	begin_phase("thread_ast");
 	Node **cfg_array = thread_ast();
+	end_phase();
 
 	if (cfg_out) {
 		for (int i = 0; i < global_function_count; i++) {
@@ -152,16 +193,23 @@ void parser_init(char *outputfile_name)
 		free(node_array);
 	}
 
+	begin_phase("sym_interpret");
 	for (int i = 0; i < global_function_count; i++) {
+		begin_function(global_functions[i]->flabel);
 		sym_interpret(cfg_array[i]);
+		end_function();
 	}
+	end_phase();
 
 	char *outputfile = malloc(strlen(outputfile_name) + 2);
 	strcpy(outputfile, outputfile_name);
 	strcat(outputfile, ".s");
 	FILE *fp = fopen(outputfile, "w");
 	set_output_file(fp);
+
+	begin_phase("gen");
 	gen(global_functions, global_function_count);
+	end_phase();
 }
 
 static Node *printCFG(Node *start)
@@ -212,6 +260,8 @@ static int get_type_specifier(Token_type *tok)
 		return TYPE_RECORD;
 	} else if (!strcmp(str, "bool")) {
 		return TYPE_BOOL;
+	} else if (!strcmp(str, "char")) {
+		return TYPE_CHAR;
 	} else {
 		return 0;
 	}
@@ -307,6 +357,8 @@ static const char *datatypeToString(int type)
 			return "\x1b[95marray\x1b[0m";
 		case TYPE_VOID:
 			return "\x1b[95mvoid\x1b[0m";
+		case TYPE_CHAR:
+			return "\x1b[95mchar\x1b[0m";
 		default:
 			return "Unknown";
 	}
@@ -980,9 +1032,26 @@ static Node *read_global_expr()
 
 	Token_type *tok = get();
 	if (!strcmp(tok->repr, "fn")) {
-		return read_fn_def(0);
+		return read_fn_def(0, 0);
 	} else if (!strcmp(tok->repr, "record")) {
 		return read_record_def();
+	} else if (!strcmp(tok->repr, "inline") || !strcmp(tok->repr, "noinline")) {
+		int hint = strcmp(tok->repr, "inline") ? -1 : 1;
+		tok = get();
+		if (!strcmp(tok->repr, "fn")) {
+			Node *fn = read_fn_def(0, 0);
+			fn->inline_hint = hint;
+			return fn;
+		} else {
+			c_error("Specifiers 'inline' and 'noinline' must be followed by function definition.", tok->line);
+		}
+	} else if (!strcmp(tok->repr, "intrinsic")) {
+		tok = get();
+		if (!strcmp(tok->repr, "fn")) {
+			return read_fn_def(0, 1);
+		} else {
+			c_error("Specifier 'intrinsic' must be followed by function declaration.", tok->line);
+		}
 	} else if (!strcmp(tok->repr, "entry")) {
 		if (entrypoint_defined) {
 			c_error("Function entry point already defined.", tok->line);
@@ -990,7 +1059,7 @@ static Node *read_global_expr()
 		tok = get();
 		if (!strcmp(tok->repr, "fn")) {
 			entrypoint_defined = 1;
-			return read_fn_def(1);
+			return read_fn_def(1, 0);
 		} else {
 			c_error("Specifier 'entry' must be followed by function definition.", tok->line);
 		}
@@ -1034,7 +1103,7 @@ static Node *read_record_def()
 	}
 }
 
-static Node *read_fn_def(int isEntry)
+static Node *read_fn_def(int isEntry, int isIntrinsic)
 {
 	Token_type *tok = get();
 	if (tok->class == IDENTIFIER) {
@@ -1064,6 +1133,20 @@ static Node *read_fn_def(int isEntry)
 			}
 		}
 
+		// intrinsics are only declared, the compiler knows what their calls do
+		if (isIntrinsic) {
+			expect(';', "Intrinsic function declarations have no body.");
+
+			Node *fn = ast_funcdef(flabel, ret_type, array_dims, params_n, 0, params, NULL, isEntry);
+			fn->intrinsic = lookup_intrinsic(flabel, params_n);
+			if (!fn->intrinsic) {
+				char msg[128];
+				snprintf(msg, sizeof(msg), "Function %s is no intrinsic.", flabel);
+				c_error(msg, tok->line);
+			}
+			return fn;
+		}
+
 		expect('{', "");
 
 		size_t stmts_n;
@@ -1207,11 +1290,48 @@ static Node *read_stmt()
 		case KEYWORD_RETURN:
 			return read_return_stmt();
 		default:
+			if (!strcmp(tok->repr, "unroll") && curr()->class == '(') {
+				return read_unroll_hint();
+			}
 			unget();
 			return NULL;
 	}
 }
 
+// 'unroll(N)' in front of a loop, unless it turns out to be a call to a function named unroll
+static Node *read_unroll_hint()
+{
+	if (Token_stream[pos+1].class != INT || Token_stream[pos+2].class != ')') {
+		unget();
+		return NULL;
+	}
+
+	int keyword = is_keyword(&Token_stream[pos+3]);
+	if (keyword != KEYWORD_WHILE && keyword != KEYWORD_FOR) {
+		unget();
+		return NULL;
+	}
+
+	next();
+	Token_type *tok = get();
+	int factor = strtol(tok->repr, NULL, 0);
+	if (factor < 1) {
+		c_error("Unroll factor must be positive.", tok->line);
+	}
+	next();
+	next();
+
+	if (keyword == KEYWORD_WHILE) {
+		Node *n = read_while_stmt();
+		n->while_unroll = factor;
+		return n;
+	} else {
+		Node *n = read_for_stmt();
+		n->for_unroll = factor;
+		return n;
+	}
+}
+
 static Node *read_if_stmt()
 {
 	expect('(', "'(' expected after keyword 'if'.");
@@ -1493,22 +1613,28 @@ static Node *read_declaration_expr(int no_assignment)
 			char *label = malloc(strlen(tok->repr) + 1);
 			strcpy(label, tok->repr);
 
+			Node *array_len = NULL;
 			for (;;) {
 				if (next_token('[')) {
 					array_size = realloc(array_size, sizeof(int) * (array_dims+1));
 					tok = get();
-					if (tok->class == INT) {
+					if (tok->class == INT && curr()->class == ']') {
 						char *end;
 						#define s (tok->repr)
 						array_size[array_dims] = strncasecmp(s, "0b", 2) ? strtol(s, &end, 0) : strtol(s, &end, 2);
 						#undef s
 						expect(']', "");
 					} else if (tok->class == ']') {
-#if DYNAMIC_ARRAYS_ENABLED
+						array_size[array_dims] = -1;	// dynamic, grows on the heap
+					} else {
+						// any other length makes a dynamic array that starts out with that many zeros
+						if (no_assignment) {
+							c_error("Only local arrays can have a length that isn't constant.", tok->line);
+						}
+						unget();
 						array_size[array_dims] = -1;
-#else
-						c_error("Invalid expression: Dynamic arrays are disabled.", -1);
-#endif
+						array_len = read_expr();
+						expect(']', "");
 					}
 					array_dims += 1;
 				} else {
@@ -1516,11 +1642,20 @@ static Node *read_declaration_expr(int no_assignment)
 				}
 			}
 
+			for (int i = 0; i < array_dims; i++) {
+				if (array_size[i] < 0 && array_dims > 1) {
+					c_error("Dynamic arrays can only have one dimension.", tok->line);
+				}
+			}
+
 			Node *lhs = ast_decl(label, type, rlabel, array_dims, array_size);
+			lhs->varray_len = array_len;
 
 			tok = get();
 			if (tok->class == '=') {
-				if (!no_assignment) {
+				if (array_len) {
+					c_error("Arrays with a length that isn't constant can't be initialized.", tok->line);
+				} else if (!no_assignment) {
 					return ast_binop('=', lhs, read_expr());
 				} else {
 					c_error("No variable assignment in function definitions or for-statements.", tok->line);
@@ -1756,6 +1891,41 @@ int find_function(char *name)
 	return -1;
 }
 
+// library functions the compiler emits itself, std.clipl declares them with 'intrinsic'
+static struct {
+	char *name;
+	size_t n_args;
+} intrinsics[] = {
+	{"len", 1},
+	{"intToStr", 1},
+	{"printInt", 1},
+	{"printString", 1},
+	{"flush", 0},
+	{"range", 2},
+};
+
+static int lookup_intrinsic(char *name, size_t n_args)
+{
+	for (int i = 0; i < sizeof(intrinsics) / sizeof(intrinsics[0]); i++) {
+		if (!strcmp(intrinsics[i].name, name) && n_args == intrinsics[i].n_args) {
+			return i+1;
+		}
+	}
+
+	return 0;
+}
+
+// a function of the same name the program defines itself is an ordinary function
+int find_intrinsic(Node *call)
+{
+	int idx = find_function(call->call_label);
+	if (idx < 0 || call->n_args != global_functions[idx]->n_params) {
+		return 0;
+	}
+
+	return global_functions[idx]->intrinsic;
+}
+
 static Node *find_record(char *name)
 {
 	for (int i = 0; i < global_record_count; i++) {
@@ -1827,7 +1997,13 @@ static void thread_expression(Node *expr)
 		case AST_BOOL:
 		case AST_FIELD_ACCESS:
 		case AST_RECORD_DEF:
+			last_node->successor = expr;
+			last_node = expr;
+			break;
 		case AST_DECLARATION:
+			if (expr->varray_len) {
+				thread_expression(expr->varray_len);
+			}
 			last_node->successor = expr;
 			last_node = expr;
 			break;
@@ -2344,6 +2520,10 @@ static void interpret_assignment_expr(Node *expr, Stack *opstack, Stack *valstac
 							pair->bval = ident_pair->bval;
 							pair->status = 1;
 							break;
+						case TYPE_CHAR:
+							checkDataType(pair, TYPE_CHAR);
+							pair->status = 1;
+							break;
 						case TYPE_ARRAY:
 							checkDataType(pair, TYPE_ARRAY);
 							if ((ident_pair->array_dims != pair->array_dims) && pair->array_dims) {
@@ -2381,6 +2561,9 @@ static void interpret_assignment_expr(Node *expr, Stack *opstack, Stack *valstac
 				break;
 			case AST_IDX_ARRAY:
 			{
+				if (rhs->lvar_valproppair->type == TYPE_CHAR) {
+					checkDataType(pair, TYPE_CHAR);
+				}
 				if (pair->type == TYPE_ARRAY) {
 					if (pair->array_dims != rhs->lvar_valproppair->array_dims) {
 						char msg[128];
@@ -2399,8 +2582,10 @@ static void interpret_assignment_expr(Node *expr, Stack *opstack, Stack *valstac
 			}
 			break;
 			case AST_FUNCTION_CALL:
-				if (rhs->global_function_idx == -2)
+				if (rhs->global_function_idx == -2) {
+					pair->status = -1;	// syscall results are only known at runtime
 					break;
+				}
 #define func (global_functions[rhs->global_function_idx])
 				if (pair->type == TYPE_ARRAY) {
 					if (func->ret_array_dims != pair->array_dims) {
@@ -2468,9 +2653,26 @@ static void interpret_declaration_expr(Node *expr, Stack *opstack, Stack *valsta
 
 	ValPropPair *pair;
 
+	if (expr->varray_len) {
+		Node *len = (Node *) pop(opstack);
+		int len_type = len->type;
+		if (len_type == AST_IDENT || len_type == AST_IDX_ARRAY) {
+			len_type = len->lvar_valproppair->type;
+		} else if (len_type == AST_FUNCTION_CALL) {
+			len_type = len->global_function_idx < 0 ? TYPE_INT
+				: global_functions[len->global_function_idx]->ret_array_dims ? TYPE_ARRAY : global_functions[len->global_function_idx]->return_type;
+		}
+		if (len_type != TYPE_INT) {
+			char msg[128];
+			sprintf(msg, "Length of array %s must be an int.", expr->vlabel);
+			c_error(msg, -1);
+		}
+	}
+
 	if (expr->v_array_dimensions) {
+		// a length given at run time fills the array with zeros
 		pair = makeValPropPair(&(ValPropPair)
-			{expr->vlabel, 0, TYPE_ARRAY, .array_type=expr->vtype, .array_dims=expr->v_array_dimensions, .array_size=expr->varray_size, .is_array_reference=0}
+			{expr->vlabel, expr->varray_len != NULL, TYPE_ARRAY, .array_type=expr->vtype, .array_dims=expr->v_array_dimensions, .array_size=expr->varray_size, .is_array_reference=0}
 		);
 	} else {
 		pair = makeValPropPair(&(ValPropPair){expr->vlabel, 0, expr->vtype});
@@ -2555,7 +2757,7 @@ static void interpret_binary_string_expr(Node *r_operand, Node *operator, Stack
 				c_error("Operands of binary operation must be of the same type.", -1);
 			}
 
-			if (ident_pair->type != TYPE_STRING) {
+			if (ident_pair->type != TYPE_STRING && (ident_pair->type != TYPE_CHAR || operator->type != AST_ADD)) {
 				c_error("Operands of binary operation must be of the same type.", -1);
 			}
 
@@ -2585,6 +2787,54 @@ static void interpret_binary_string_expr(Node *r_operand, Node *operator, Stack
 	}
 }
 
+// a char and a string make a string, chars compare with chars and one-character string literals
+static void interpret_binary_char_expr(Node *r_operand, Node *operator, Stack *opstack, Stack *valstack)
+{
+	int r_type;
+	switch (r_operand->type)
+	{
+		case AST_IDENT:
+		case AST_IDX_ARRAY:
+			r_type = r_operand->lvar_valproppair->type;
+			if (r_operand->lvar_valproppair->status == 0) {
+				c_error("Right operand of binary operation not initialized.", -1);
+			}
+			break;
+		case AST_FUNCTION_CALL:
+			r_type = global_functions[r_operand->global_function_idx]->return_type;
+			break;
+		default:
+			r_type = r_operand->type;
+			break;
+	}
+
+	switch (operator->type)
+	{
+		case AST_ADD:
+			if (r_type != TYPE_STRING && r_type != TYPE_CHAR) {
+				c_error("Only strings and chars can be appended to a char.", -1);
+			}
+			operator->result_type = TYPE_STRING;
+			push(opstack, ast_stringtype("", -1, 0));
+			break;
+		case AST_EQ:
+		case AST_NE:
+		case AST_LT:
+		case AST_GT:
+		case AST_LE:
+		case AST_GE:
+			if (r_type != TYPE_CHAR && !(r_operand->type == AST_STRING && r_operand->slen == 1)) {
+				c_error("A char can only be compared with a char or a one-character string.", -1);
+			}
+			operator->result_type = TYPE_CHAR;
+			push(opstack, ast_booltype(1));
+			break;
+		default:
+			c_error("Illegal operation on value with type char.", -1);
+			break;
+	}
+}
+
 static void interpret_binary_ident_expr(Node *l_operand, Node *r_operand, Node *operator, Stack *opstack, Stack *valstack)
 {
 	ValPropPair *l_op_pair = l_operand->lvar_valproppair;
@@ -2603,6 +2853,9 @@ static void interpret_binary_ident_expr(Node *l_operand, Node *r_operand, Node *
 		case TYPE_STRING:
 			interpret_binary_string_expr(r_operand, operator, opstack, valstack);
 			break;
+		case TYPE_CHAR:
+			interpret_binary_char_expr(r_operand, operator, opstack, valstack);
+			break;
 		case TYPE_ARRAY:
 			switch (r_operand->type)
 			{
@@ -2762,6 +3015,11 @@ static void interpret_binary_array_expr(Node *l_operand, Node *r_operand, Node *
 
 static void interpret_binary_idx_expr(Node *l_operand, Node *r_operand, Node *operator, Stack *opstack, Stack *valstack)
 {
+	if (l_operand->lvar_valproppair->type == TYPE_CHAR) {
+		interpret_binary_char_expr(r_operand, operator, opstack, valstack);
+		return;
+	}
+
 	switch (r_operand->type)
 	{
 		case AST_INT:
@@ -2895,6 +3153,19 @@ static void interpret_func_call(Node *n, Stack **opstack, Stack **valstack)
 {
 	for (int i = 0; i < n->n_args; i++) {
 		pop(*opstack);
+
+		// dynamic array parameters are handed the header of the array, fixed-size ones its elements
+		if (n->global_function_idx >= 0 && !find_intrinsic(n) && i < global_functions[n->global_function_idx]->n_params
+		    && n->callargs[i]->type == AST_IDENT && n->callargs[i]->lvar_valproppair->type == TYPE_ARRAY) {
+			Node *param = global_functions[n->global_function_idx]->fnparams[i];
+			if (param->v_array_dimensions && (param->varray_size[0] < 0) != (n->callargs[i]->lvar_valproppair->array_size[0] < 0)) {
+				char msg[128];
+				sprintf(msg, "Array %s can't be passed as parameter %s of function %s, only one of them is dynamic.",
+					n->callargs[i]->name, param->vlabel, n->call_label);
+				c_error(msg, -1);
+			}
+		}
+
 		switch (n->callargs[i]->type)
 		{
 			case AST_ASSIGN:
@@ -2988,6 +3259,14 @@ static Node *interpret_expr(Node *expr, Stack **opstack, Stack **valstack)
 				sprintf(msg, "No variable with name %s has been declared.", expr->name);
 				c_error(msg, -1);
 			}
+			if (pair->type == TYPE_STRING && expr->ndim_index == 1) {
+				// indexing a string gives one of its bytes
+				pop(*opstack);
+				expr->lvar_valproppair = makeValPropPair(&(ValPropPair){expr->ia_label, 1, TYPE_CHAR, .ref_array=pair});
+				push(*opstack, expr);
+				interpret_expr(expr->successor, opstack, valstack);
+				break;
+			}
 			if (pair->type != TYPE_ARRAY) {
 				char *msg = malloc(128);
 				sprintf(msg, "Variable %s is not an array.", pair->var_name);
@@ -3014,7 +3293,7 @@ static Node *interpret_expr(Node *expr, Stack **opstack, Stack **valstack)
 			}
 
 			for (int i = 0; i < expr->ndim_index; i++) {
-				if ((expr->index_values[i]->type == AST_INT) && (expr->index_values[i]->ival > pair->array_size[i]-1)) {
+				if ((expr->index_values[i]->type == AST_INT) && pair->array_size[i] >= 0 && (expr->index_values[i]->ival > pair->array_size[i]-1)) {
 						c_error("Array index can't be bigger than array size.", -1);
 				}
 			}
@@ -3088,7 +3367,7 @@ static Node *interpret_expr(Node *expr, Stack **opstack, Stack **valstack)
 			}
 
 			expr->global_function_idx = idx;
-			if (idx >= 0) {
+			if (idx >= 0 && !find_intrinsic(expr)) {
 				global_functions[idx]->is_called = 1;
 			}
 
@@ -5,6 +5,15 @@ enum {
        KEYWORD_RETURN,
 };
 
+enum {
+	INTRINSIC_LEN = 1,	// string or array length, kept next to the data
+	INTRINSIC_INT_TO_STR,
+	INTRINSIC_PRINT_INT,
+	INTRINSIC_PRINT_STRING,	// buffered, see rt_print
+	INTRINSIC_FLUSH,
+	INTRINSIC_RANGE,	// only as what a for loop iterates over
+};
+
 enum {
 	TYPE_INT = 1,
 	TYPE_FLOAT,
@@ -13,6 +22,7 @@ enum {
 	TYPE_ARRAY,
 	TYPE_RECORD,
 	TYPE_VOID,
+	TYPE_CHAR,	// a byte of a string, lives in a register like an int
 };
 
 enum {
@@ -95,6 +105,7 @@ typedef struct ValPropPair {
 	struct ValPropPair *ref_array;
 	// generation
 	int loff;
+	int home;	// virtual register of a promoted scalar, 0 if it lives at loff
 	char *asmlabel;
 } ValPropPair;
 
@@ -153,6 +164,7 @@ typedef struct Node {
 			char *vrlabel;
 			int v_array_dimensions;
 			int *varray_size;
+			struct Node *varray_len;	// length of a dynamic array given at run time, 'int a[n]'
 		};
 		// record definition
 		struct {
@@ -170,6 +182,8 @@ typedef struct Node {
 			struct Node **fnparams;
 			struct Node **fnbody;
 			int global_idx;
+			int inline_hint;	// 1 -> 'inline', -1 -> 'noinline', 0 -> left to the inliner
+			int intrinsic;		// INTRINSIC_* if declared 'intrinsic', its calls are emitted by the compiler
 			// used in generation
 			int is_fn_entrypoint;
 			int is_called;
@@ -201,6 +215,7 @@ typedef struct Node {
 			struct Node *while_cond;
 			size_t n_while_stmts;
 			struct Node **while_body;
+			int while_unroll;	// factor given by 'unroll(N)', 0 -> left to the unroller
 			// cfg
 			struct Node *while_true_successor;
 		};
@@ -210,6 +225,7 @@ typedef struct Node {
 			struct Node *for_enum;
 			size_t n_for_stmts;
 			struct Node **for_body;
+			int for_unroll;		// same as while_unroll
 			// cfg
 			struct Node *for_loop_successor;
 		};
@@ -225,6 +241,7 @@ typedef struct Node {
 void parser_init();
 int numPlaces();
 int find_function();
+int find_intrinsic();
 ValPropPair *makeValPropPair();
 Node *makeNode();
 
@@ -236,3 +253,10 @@ extern int cfg_out;
 extern int sym_out;
 extern int live_out;
 extern int ps_out;
+extern int omit_frame_pointer;
+extern int no_inline;
+extern int no_unroll;
+extern int no_ctfe;
+extern int avx2;
+extern int no_buffered_output;
+extern int time_report;
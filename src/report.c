@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/resource.h>
+
+#include "parse.h"
+#include "report.h"
+
+#define REPORT_MAX_PHASES	32
+#define REPORT_MAX_DEPTH	8
+#define REPORT_TOP_FUNCTIONS	10	// functions listed in the breakdown
+
+typedef struct {
+	double wall;	// seconds
+	double cpu;	// seconds, own and that of finished child processes
+	long heap;	// bytes allocated with malloc and not freed yet
+} Sample;
+
+typedef struct {
+	char *name;
+	int depth;
+	int calls;
+	Sample total;
+	long peak_rss;	// KB, of the compiler or, for nasm and ld, of the biggest child process
+	int external;	// time is spent in child processes
+} Phase;
+
+typedef struct {
+	char *name;
+	char *phase;
+	Sample total;
+} FunctionTime;
+
+static Phase phases[REPORT_MAX_PHASES];
+static int n_phases;
+
+// phases currently running, and what was measured when they started
+static int open_phases[REPORT_MAX_DEPTH];
+static Sample open_starts[REPORT_MAX_DEPTH];
+static int depth;
+
+static FunctionTime *functions;
+static size_t n_functions;
+static char *current_function;
+static Sample function_start;
+
+// Measuring
+
+static double seconds(struct timespec t)
+{
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static double tv_seconds(struct timeval t)
+{
+	return t.tv_sec + t.tv_usec / 1e6;
+}
+
+static long heap_in_use()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+static Sample sample()
+{
+	struct timespec wall, cpu;
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+
+	struct rusage children;
+	getrusage(RUSAGE_CHILDREN, &children);
+
+	return (Sample){seconds(wall), seconds(cpu) + tv_seconds(children.ru_utime) + tv_seconds(children.ru_stime), heap_in_use()};
+}
+
+static void add_since(Sample *total, Sample start)
+{
+	Sample now = sample();
+	total->wall += now.wall - start.wall;
+	total->cpu += now.cpu - start.cpu;
+	total->heap += now.heap - start.heap;
+}
+
+static long peak_rss(int who)
+{
+	struct rusage usage;
+	getrusage(who, &usage);
+	return usage.ru_maxrss;
+}
+
+// Phases
+
+// phases of the same name under the same parent add up, e.g. the rounds of lva and color
+static int find_phase(char *name)
+{
+	int parent = depth ? open_phases[depth-1] : -1;
+	for (int i = n_phases-1; i > parent; i--) {
+		if (phases[i].depth == depth && !strcmp(phases[i].name, name)) {
+			return i;
+		}
+	}
+
+	if (n_phases == REPORT_MAX_PHASES) {
+		return -1;
+	}
+	phases[n_phases] = (Phase){name, depth, 0, {0, 0, 0}, 0, 0};
+	return n_phases++;
+}
+
+void begin_phase(char *name)
+{
+	if (!time_report || depth == REPORT_MAX_DEPTH) {
+		return;
+	}
+
+	int idx = find_phase(name);
+	if (idx < 0) {
+		return;
+	}
+
+	// nasm and ld run as child processes
+	phases[idx].external = !strcmp(name, "nasm") || !strcmp(name, "ld");
+	phases[idx].calls++;
+	open_phases[depth] = idx;
+	open_starts[depth] = sample();
+	depth++;
+}
+
+void end_phase()
+{
+	if (!time_report || depth == 0) {
+		return;
+	}
+
+	depth--;
+	Phase *p = &phases[open_phases[depth]];
+	add_since(&p->total, open_starts[depth]);
+	p->peak_rss = peak_rss(p->external ? RUSAGE_CHILDREN : RUSAGE_SELF);
+}
+
+// the time until end_function counts towards the function in the innermost running phase
+void begin_function(char *name)
+{
+	if (!time_report) {
+		return;
+	}
+
+	current_function = name;
+	function_start = sample();
+}
+
+void end_function()
+{
+	if (!time_report || current_function == NULL) {
+		return;
+	}
+
+	char *phase = depth ? phases[open_phases[depth-1]].name : "";
+	FunctionTime *f = NULL;
+	for (int i = 0; i < n_functions; i++) {
+		if (!strcmp(functions[i].name, current_function) && !strcmp(functions[i].phase, phase)) {
+			f = &functions[i];
+			break;
+		}
+	}
+
+	if (f == NULL) {
+		functions = realloc(functions, sizeof(FunctionTime) * (n_functions+1));
+		f = &functions[n_functions++];
+		*f = (FunctionTime){current_function, phase, {0, 0, 0}};
+	}
+
+	add_since(&f->total, function_start);
+	current_function = NULL;
+}
+
+// Output
+
+static int by_wall(const void *a, const void *b)
+{
+	double d = ((FunctionTime *) b)->total.wall - ((FunctionTime *) a)->total.wall;
+	return (d > 0) - (d < 0);
+}
+
+static void print_text(Sample total, int n_top)
+{
+	fprintf(stderr, "\nTime report:\n");
+	fprintf(stderr, "%-28s %10s %10s %10s %14s\n", "phase", "wall (ms)", "cpu (ms)", "heap (KB)", "peak rss (KB)");
+
+	for (int i = 0; i < n_phases; i++) {
+		Phase *p = &phases[i];
+		char name[64];
+		if (p->calls > 1) {
+			snprintf(name, sizeof(name), "%*s%s (x%d)", p->depth*2, "", p->name, p->calls);
+		} else {
+			snprintf(name, sizeof(name), "%*s%s", p->depth*2, "", p->name);
+		}
+		fprintf(stderr, "%-28s %10.3f %10.3f %10ld %14ld\n", name, p->total.wall*1e3, p->total.cpu*1e3, p->total.heap/1024, p->peak_rss);
+	}
+	fprintf(stderr, "%-28s %10.3f %10.3f %10ld %14ld\n", "total", total.wall*1e3, total.cpu*1e3, total.heap/1024, peak_rss(RUSAGE_SELF));
+
+	if (n_top) {
+		fprintf(stderr, "\nMost expensive functions:\n");
+		fprintf(stderr, "%-28s %-16s %10s %10s %10s\n", "function", "phase", "wall (ms)", "cpu (ms)", "heap (KB)");
+		for (int i = 0; i < n_top; i++) {
+			FunctionTime *f = &functions[i];
+			fprintf(stderr, "%-28s %-16s %10.3f %10.3f %10ld\n", f->name, f->phase, f->total.wall*1e3, f->total.cpu*1e3, f->total.heap/1024);
+		}
+	}
+}
+
+static void print_json(Sample total, int n_top)
+{
+	fprintf(stderr, "{\"phases\": [");
+	for (int i = 0; i < n_phases; i++) {
+		Phase *p = &phases[i];
+		fprintf(stderr, "%s\n  {\"name\": \"%s\", \"depth\": %d, \"calls\": %d, \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"heap_kb\": %ld, \"peak_rss_kb\": %ld}",
+			i ? "," : "", p->name, p->depth, p->calls, p->total.wall*1e3, p->total.cpu*1e3, p->total.heap/1024, p->peak_rss);
+	}
+
+	// function names are identifiers, so they never need escaping
+	fprintf(stderr, "\n], \"functions\": [");
+	for (int i = 0; i < n_top; i++) {
+		FunctionTime *f = &functions[i];
+		fprintf(stderr, "%s\n  {\"name\": \"%s\", \"phase\": \"%s\", \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"heap_kb\": %ld}",
+			i ? "," : "", f->name, f->phase, f->total.wall*1e3, f->total.cpu*1e3, f->total.heap/1024);
+	}
+
+	fprintf(stderr, "\n], \"total\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"heap_kb\": %ld, \"peak_rss_kb\": %ld}}\n",
+		total.wall*1e3, total.cpu*1e3, total.heap/1024, peak_rss(RUSAGE_SELF));
+}
+
+// Prints what was measured to stderr, the total covers the top-level phases.
+void print_time_report()
+{
+	if (!time_report) {
+		return;
+	}
+
+	Sample total = {0, 0, 0};
+	for (int i = 0; i < n_phases; i++) {
+		if (phases[i].depth == 0) {
+			total.wall += phases[i].total.wall;
+			total.cpu += phases[i].total.cpu;
+			total.heap += phases[i].total.heap;
+		}
+	}
+
+	qsort(functions, n_functions, sizeof(FunctionTime), by_wall);
+	int n_top = n_functions < REPORT_TOP_FUNCTIONS ? n_functions : REPORT_TOP_FUNCTIONS;
+
+	if (time_report == TIME_REPORT_JSON) {
+		print_json(total, n_top);
+	} else {
+		print_text(total, n_top);
+	}
+}
@@ -0,0 +1,10 @@
+enum {
+	TIME_REPORT_TEXT = 1,
+	TIME_REPORT_JSON,
+};
+
+void begin_phase();
+void end_phase();
+void begin_function();
+void end_function();
+void print_time_report();
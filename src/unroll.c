@@ -0,0 +1,395 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "parse.h"
+#include "error.h"
+#include "ast.h"
+#include "unroll.h"
+
+#define FULL_UNROLL_TRIPS	16	// iterations a loop may have to be unrolled completely
+#define FULL_UNROLL_NODES	96	// AST nodes the completely unrolled loop may grow to
+#define PARTIAL_UNROLL_NODES	128	// same for the body of a partially unrolled loop
+
+typedef struct {
+	char *name;
+	Node *decl;
+	int count;
+} DeclSearch;
+
+static Node **unroll_block();
+
+static Node *current_fn;
+static int unroll_count;
+
+static Node *int_node(int v)
+{
+	return makeNode(&(Node){AST_INT, .ival=v});
+}
+
+static void find_declaration(Node *n, void *data)
+{
+	DeclSearch *search = data;
+	if (n->type == AST_DECLARATION && !strcmp(n->vlabel, search->name)) {
+		search->decl = n;
+		search->count++;
+	}
+}
+
+// the declaration of name in the current function, NULL unless there is exactly one
+static Node *declaration_of(char *name)
+{
+	DeclSearch search = {name, NULL, 0};
+	visit_block(current_fn->fnparams, current_fn->n_params, find_declaration, &search);
+	visit_block(current_fn->fnbody, current_fn->n_stmts, find_declaration, &search);
+
+	return search.count == 1 ? search.decl : NULL;
+}
+
+static void count_uses(Node *n, void *data)
+{
+	DeclSearch *search = data;
+	if ((n->type == AST_IDENT && !strcmp(n->name, search->name)) || (n->type == AST_IDX_ARRAY && !strcmp(n->ia_label, search->name))) {
+		search->count++;
+	}
+}
+
+// locals of a loop body stay visible after the loop, copies of the body can't share them if they're used there
+static int locals_escape(Node **body, size_t n)
+{
+	RenameMap map = {NULL, NULL, NULL, 0};
+	visit_block(body, n, collect_locals, &map);
+
+	for (int i = 0; i < map.size; i++) {
+		DeclSearch inside = {map.from[i], NULL, 0};
+		DeclSearch everywhere = {map.from[i], NULL, 0};
+		visit_block(body, n, count_uses, &inside);
+		visit_block(current_fn->fnbody, current_fn->n_stmts, count_uses, &everywhere);
+		if (inside.count != everywhere.count) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// appends a copy of the loop body to out, with locals of its own
+static void copy_body(Node **body, size_t n, Node ***out, size_t *out_sz)
+{
+	// '$' can't appear in source identifiers and no function has an empty name
+	int k = unroll_count++;
+	RenameMap map = {NULL, NULL, NULL, 0};
+	visit_block(body, n, collect_locals, &map);
+	for (int i = 0; i < map.size; i++) {
+		map.to[i] = unique_name("", k, map.from[i]);
+	}
+
+	Node **copy = clone_block(body, n, &map);
+	for (int i = 0; i < n; i++) {
+		append(out, out_sz, copy[i]);
+	}
+}
+
+// returns the number of iterations to unroll per loop iteration, trips for a complete unroll, 0 for none
+static int unroll_factor(int hint, int trips, Node **body, size_t n)
+{
+	if (hint == 1 || trips <= 0 || locals_escape(body, n)) {
+		return 0;
+	} else if (hint > 1) {
+		return hint < trips ? hint : trips;
+	}
+
+	int size = 0;
+	visit_block(body, n, count_node, &size);
+
+	if (trips <= FULL_UNROLL_TRIPS && size * trips <= FULL_UNROLL_NODES) {
+		return trips;
+	}
+
+	for (int f = 8; f >= 4; f /= 2) {
+		if (trips >= 2*f && size * f <= PARTIAL_UNROLL_NODES) {
+			return f;
+		}
+	}
+
+	return 0;
+}
+
+static Node *while_node(Node *cond, Node **body, size_t n)
+{
+	// what comes out of the unroller is never unrolled again
+	return makeNode(&(Node){AST_WHILE_STMT, .while_cond=cond, .n_while_stmts=n, .while_body=body, .while_unroll=1});
+}
+
+// For loops
+
+// iterations of a for loop over a fixed-size array or a constant range with a scalar iterator, 0 if not known
+static int for_trips(Node *s)
+{
+	Node *it = s->for_iterator;
+	Node *e = s->for_enum;
+	if (it->v_array_dimensions || (it->vtype != TYPE_INT && it->vtype != TYPE_BOOL)) {
+		return 0;
+	}
+
+	if (e->type == AST_ARRAY) {
+		for (int i = 0; i < e->array_size; i++) {
+			if (e->array_elems[i]->type != AST_INT && e->array_elems[i]->type != AST_BOOL) {
+				return 0;
+			}
+		}
+		return e->array_size;
+	} else if (e->type == AST_FUNCTION_CALL && find_intrinsic(e) == INTRINSIC_RANGE) {
+		Node *start = e->callargs[0];
+		Node *end = e->callargs[1];
+		if (it->vtype == TYPE_INT && start->type == AST_INT && end->type == AST_INT && end->ival > start->ival) {
+			return end->ival - start->ival;
+		}
+	} else if (e->type == AST_IDENT) {
+		Node *decl = declaration_of(e->name);
+		if (decl && decl->v_array_dimensions == 1 && decl->varray_size[0] > 0) {
+			return decl->varray_size[0];
+		}
+	}
+
+	return 0;
+}
+
+// element idx of what the loop iterates over, idx is a constant for literals
+static Node *element(Node *s, Node *idx)
+{
+	Node *e = s->for_enum;
+	if (e->type == AST_ARRAY) {
+		return clone_block(&e->array_elems[idx->ival], 1, &(RenameMap){NULL, NULL, NULL, 0})[0];
+	} else if (e->type == AST_FUNCTION_CALL) {
+		return int_node(e->callargs[0]->ival + idx->ival);
+	}
+
+	Node **index = malloc(sizeof(Node *));
+	index[0] = idx;
+	return makeNode(&(Node){AST_IDX_ARRAY, .ia_label=e->name, .index_values=index, .ndim_index=1});
+}
+
+static int unroll_for(Node *s, Node ***out, size_t *out_sz)
+{
+	// sums are left to the vectorizer unless asked for otherwise
+	if (vector_sum(s) && !s->for_unroll) {
+		return 0;
+	}
+
+	int trips = for_trips(s);
+	int factor = unroll_factor(s->for_unroll, trips, s->for_body, s->n_for_stmts);
+	// literals and ranges are only ever unrolled completely, the generator walks them well enough
+	if (!factor || (factor < trips && s->for_enum->type != AST_IDENT)) {
+		if (s->for_unroll > 1) {
+			c_warning("Loop can't be unrolled.", -1);
+		}
+		return 0;
+	}
+
+	// the iterator keeps its name, it's still visible after the loop
+	Node *it = s->for_iterator;
+	char *name = it->vlabel;
+
+	if (factor == trips) {
+		for (int j = 0; j < trips; j++) {
+			Node *lhs = j ? ident(name) : it;
+			append(out, out_sz, assignment(lhs, element(s, int_node(j))));
+			copy_body(s->for_body, s->n_for_stmts, out, out_sz);
+		}
+		return 1;
+	}
+
+	char *idx = unique_name("", unroll_count++, "");
+	append(out, out_sz, assignment(declaration(idx, TYPE_INT), int_node(0)));
+	append(out, out_sz, assignment(it, zero_value(it->vtype)));
+
+	Node **body = NULL;
+	size_t body_sz = 0;
+	for (int j = 0; j < factor; j++) {
+		Node *i = j ? makeNode(&(Node){AST_ADD, .left=ident(idx), .right=int_node(j)}) : ident(idx);
+		append(&body, &body_sz, assignment(ident(name), element(s, i)));
+		copy_body(s->for_body, s->n_for_stmts, &body, &body_sz);
+	}
+	append(&body, &body_sz, makeNode(&(Node){AST_ADD_ASSIGN, .left=ident(idx), .right=int_node(factor)}));
+
+	Node *cond = makeNode(&(Node){AST_LT, .left=ident(idx), .right=int_node(trips - trips % factor)});
+	append(out, out_sz, while_node(cond, body, body_sz));
+
+	if (trips % factor) {
+		body = NULL;
+		body_sz = 0;
+		append(&body, &body_sz, assignment(ident(name), element(s, ident(idx))));
+		copy_body(s->for_body, s->n_for_stmts, &body, &body_sz);
+		append(&body, &body_sz, makeNode(&(Node){AST_ADD_ASSIGN, .left=ident(idx), .right=int_node(1)}));
+
+		cond = makeNode(&(Node){AST_LT, .left=ident(idx), .right=int_node(trips)});
+		append(out, out_sz, while_node(cond, body, body_sz));
+	}
+
+	return 1;
+}
+
+// While loops
+
+// the constant step of 'i += step' or 'i = i + step' ending a loop body, 0 if it's something else
+static int step_of(Node *s, char *var)
+{
+	if (s->type == AST_ADD_ASSIGN && s->left->type == AST_IDENT && !strcmp(s->left->name, var)
+	    && s->right->type == AST_INT) {
+		return s->right->ival;
+	}
+
+	if (s->type == AST_ASSIGN && s->left->type == AST_IDENT && !strcmp(s->left->name, var) && s->right->type == AST_ADD) {
+		Node *l = s->right->left;
+		Node *r = s->right->right;
+		if (l->type == AST_IDENT && !strcmp(l->name, var) && r->type == AST_INT) {
+			return r->ival;
+		} else if (r->type == AST_IDENT && !strcmp(r->name, var) && l->type == AST_INT) {
+			return l->ival;
+		}
+	}
+
+	return 0;
+}
+
+// iterations of 'while (i < C) { ...; i += step; }' with i set to a constant before it, 0 if not known
+static int while_trips(Node *s, Node **prev, size_t prev_sz, int *start, int *step)
+{
+	Node *cond = s->while_cond;
+	if ((cond->type != AST_LT && cond->type != AST_LE) || cond->left->type != AST_IDENT || cond->right->type != AST_INT) {
+		return 0;
+	}
+	char *var = cond->left->name;
+
+	// the closest statement in front of the loop that sets the variable
+	Node *init = NULL;
+	for (int i = prev_sz-1; i >= 0 && !init; i--) {
+		Node *p = prev[i];
+		Node *lhs = p->type == AST_ASSIGN ? p->left : NULL;
+		if (lhs && ((lhs->type == AST_IDENT && !strcmp(lhs->name, var)) || (lhs->type == AST_DECLARATION && !strcmp(lhs->vlabel, var)))) {
+			init = p;
+			break;
+		}
+
+		char *name = var;
+		visit_block(&p, 1, find_assigned, &name);
+		if (name == NULL) {
+			return 0;
+		}
+	}
+	if (init == NULL || init->right->type != AST_INT) {
+		return 0;
+	}
+
+	size_t n = s->n_while_stmts;
+	if (!n || (*step = step_of(s->while_body[n-1], var)) <= 0) {
+		return 0;
+	}
+
+	// the loop variable may change nowhere else
+	char *name = var;
+	visit_block(s->while_body, n-1, find_assigned, &name);
+	DeclSearch search = {var, NULL, 0};
+	visit_block(s->while_body, n, find_declaration, &search);
+	if (name == NULL || search.count) {
+		return 0;
+	}
+
+	*start = init->right->ival;
+	long end = cond->right->ival + (cond->type == AST_LE);
+	if (end <= *start) {
+		return 0;
+	}
+
+	return (end - *start + *step - 1) / *step;
+}
+
+static int unroll_while(Node *s, Node ***out, size_t *out_sz)
+{
+	int start, step;
+	int trips = while_trips(s, *out, *out_sz, &start, &step);
+	int factor = unroll_factor(s->while_unroll, trips, s->while_body, s->n_while_stmts);
+	if (!factor) {
+		if (s->while_unroll > 1) {
+			c_warning("Loop can't be unrolled.", -1);
+		}
+		return 0;
+	}
+
+	// every copy keeps its own increment, so the loop variable ends up where the loop would leave it
+	if (factor == trips) {
+		for (int j = 0; j < trips; j++) {
+			copy_body(s->while_body, s->n_while_stmts, out, out_sz);
+		}
+		return 1;
+	}
+
+	Node **body = NULL;
+	size_t body_sz = 0;
+	for (int j = 0; j < factor; j++) {
+		copy_body(s->while_body, s->n_while_stmts, &body, &body_sz);
+	}
+
+	int bound = start + (trips - trips % factor) * step;
+	Node *cond = makeNode(&(Node){AST_LT, .left=ident(s->while_cond->left->name), .right=int_node(bound)});
+	append(out, out_sz, while_node(cond, body, body_sz));
+
+	// the original loop takes care of the remaining iterations
+	if (trips % factor) {
+		s->while_unroll = 1;
+		append(out, out_sz, s);
+	}
+
+	return 1;
+}
+
+static Node **unroll_block(Node **block, size_t *n)
+{
+	Node **out = NULL;
+	size_t out_sz = 0;
+
+	for (int i = 0; i < *n; i++) {
+		Node *s = block[i];
+
+		// inner loops first, so their unrolled form counts towards the size of the outer body
+		switch (s->type)
+		{
+			case AST_IF_STMT:
+				s->if_body = unroll_block(s->if_body, &s->n_if_stmts);
+				if (s->n_else_stmts) {
+					s->else_body = unroll_block(s->else_body, &s->n_else_stmts);
+				}
+				break;
+			case AST_WHILE_STMT:
+				s->while_body = unroll_block(s->while_body, &s->n_while_stmts);
+				if (unroll_while(s, &out, &out_sz)) {
+					continue;
+				}
+				break;
+			case AST_FOR_STMT:
+				s->for_body = unroll_block(s->for_body, &s->n_for_stmts);
+				if (unroll_for(s, &out, &out_sz)) {
+					continue;
+				}
+				break;
+		}
+
+		append(&out, &out_sz, s);
+	}
+
+	*n = out_sz;
+	return out;
+}
+
+// Unrolls loops with trip counts known at compile time, completely if the result stays small and by
+// a factor of 4 or 8 otherwise.
+void unroll_loops()
+{
+	unroll_count = 0;
+
+	for (int i = 0; i < global_function_count; i++) {
+		current_fn = global_functions[i];
+		current_fn->fnbody = unroll_block(current_fn->fnbody, &current_fn->n_stmts);
+	}
+}
@@ -0,0 +1 @@
+void unroll_loops();
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Compiles and runs every program in this directory, comparing what it prints with its .expected file.
+# Compiling needs nasm and ld, std.clipl is imported from examples/.
+cd "$(dirname "$0")/../examples" || exit 1
+
+status=0
+for f in ../tests/*.clipl; do
+	name=$(basename "$f" .clipl)
+	bin=$(mktemp)
+	if ../src/clipl "$f" -o "$bin" "$@" > /dev/null && [ "$("$bin")" = "$(cat "../tests/$name.expected")" ]; then
+		echo "PASS $name"
+	else
+		echo "FAIL $name"
+		status=1
+	fi
+	rm -f "$bin"
+done
+
+exit $status